@@ -0,0 +1,276 @@
+#ifndef BOXKDTREE_H
+#define BOXKDTREE_H
+
+#include "point&plane.h"
+#include "QueryStats.h"
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+////// static KD Tree with a bounding box in every node and up to leafSize points in every leaf.
+////// A subtree is skipped when the box is farther than the best distance, not only the split plane,
+////// and the points of a leaf are scanned together from coordinate arrays (structure of arrays)
+template<int D = 3, class T = float>
+class BoxKDTree
+{
+    typedef Point<D, T> PointT;
+    static const uint32_t NONE = UINT32_MAX;
+    static const size_t MAXLEAF = 256;
+    struct BoxNode
+    {
+        T lo[D], hi[D]; // the bounding box of the points of the subtree
+        uint32_t begin, end; // the points of the subtree are pts[begin .. end)
+        uint32_t right; // the left child is the next node, right is NONE for a leaf
+    };
+    size_t leafSize;
+    vector<BoxNode> nodes; // nodes in preorder, nodes[0] is the root
+    vector<PointT> pts; // points in the order of the leaves
+    vector<T> coords; // coordinate u of point i is coords[u*pts.size() + i]
+
+    ////// build the subtree of pts[begin .. end), return the index of its root
+    uint32_t buildRec(uint32_t begin, uint32_t end)
+    {
+        uint32_t index = nodes.size();
+        nodes.push_back(BoxNode());
+        BoxNode box;
+        for (int u=0; u<D; u++) {
+            box.lo[u] = numeric_limits<T>::max();
+            box.hi[u] = numeric_limits<T>::lowest();
+        }
+        for (uint32_t i=begin; i<end; i++) {
+            for (int u=0; u<D; u++) {
+                box.lo[u] = min(box.lo[u], pts[i][u]);
+                box.hi[u] = max(box.hi[u], pts[i][u]);
+            }
+        }
+        box.begin = begin;
+        box.end = end;
+        box.right = NONE;
+        if (end - begin > leafSize) {
+            // split the widest side of the box at the median
+            int d = 0;
+            for (int u=1; u<D; u++)
+                if (box.hi[u] - box.lo[u] > box.hi[d] - box.lo[d]) d = u;
+            uint32_t mid = begin + (end - begin)/2;
+            nth_element(pts.begin() + begin, pts.begin() + mid, pts.begin() + end,
+                        [d](const PointT& a, const PointT& b) {return a[d] < b[d];});
+            buildRec(begin, mid);
+            box.right = buildRec(mid, end);
+        }
+        nodes[index] = box;
+        return index;
+    }
+
+    ////// square distance from key to the box, 0 if key is inside
+    T boxDistance(const BoxNode& box, const PointT& key) const
+    {
+        T dis = 0;
+        for (int u=0; u<D; u++) {
+            T diff = max(box.lo[u] - key[u], max(T(0), key[u] - box.hi[u]));
+            dis += diff*diff;
+        }
+        return dis;
+    }
+
+    ////// square distance from key to the farthest corner of the box
+    T boxFarDistance(const BoxNode& box, const PointT& key) const
+    {
+        T dis = 0;
+        for (int u=0; u<D; u++) {
+            T diff = max(key[u] - box.lo[u], box.hi[u] - key[u]);
+            dis += diff*diff;
+        }
+        return dis;
+    }
+
+    ////// square distances from key to the points of a leaf, the inner loop runs over points so it is vectorized
+    void leafDistances(const BoxNode& leaf, const PointT& key, T* dis) const
+    {
+        uint32_t m = leaf.end - leaf.begin;
+        STATS_ADD(DISTANCE_EVALS, m);
+        for (uint32_t j=0; j<m; j++) dis[j] = 0;
+        for (int u=0; u<D; u++) {
+            const T* c = coords.data() + u*pts.size() + leaf.begin;
+            T ku = key[u];
+            for (uint32_t j=0; j<m; j++) {
+                T diff = c[j] - ku;
+                dis[j] += diff*diff;
+            }
+        }
+    }
+public:
+    BoxKDTree(size_t leafSize = 16) {setLeafSize(leafSize);}
+    BoxKDTree(const vector<PointT>& points, size_t leafSize = 16) {setLeafSize(leafSize); build(points);}
+    BoxKDTree(vector<PointT>&& points, size_t leafSize = 16) {setLeafSize(leafSize); build(move(points));}
+
+    ////// the number of points of a leaf, takes effect at the next build
+    void setLeafSize(size_t leafSize)
+    {
+        if (leafSize < 1 || leafSize > MAXLEAF) throw "leaf size is out of range";
+        this->leafSize = leafSize;
+    }
+
+    size_t getLeafSize() const {return leafSize;}
+
+    void build(const vector<PointT>& points)
+    {
+        build(vector<PointT>(points));
+    }
+
+    void build(vector<PointT>&& points) ////// the points are moved into the tree without copying
+    {
+        if (points.size() >= NONE) throw "too many points";
+        clear();
+        pts = move(points);
+        if (pts.empty()) return;
+        nodes.reserve(2*(pts.size()/leafSize + 1));
+        buildRec(0, pts.size());
+        coords.resize(D*pts.size());
+        for (size_t i=0; i<pts.size(); i++)
+            for (int u=0; u<D; u++) coords[u*pts.size() + i] = pts[i][u];
+    }
+
+    void clear()
+    {
+        vector<BoxNode>().swap(nodes);
+        vector<PointT>().swap(pts);
+        vector<T>().swap(coords);
+    }
+
+    ////// exactly search, only the boxes containing key are visited
+    bool searchRec(uint32_t index, const PointT& key) const
+    {
+        const BoxNode& box = nodes[index];
+        for (int u=0; u<D; u++)
+            if (key[u] < box.lo[u] || key[u] > box.hi[u]) return 0;
+        if (box.right == NONE) {
+            for (uint32_t i=box.begin; i<box.end; i++)
+                if (pts[i] == key) return 1;
+            return 0;
+        }
+        return searchRec(index + 1, key) || searchRec(box.right, key);
+    }
+
+    bool search(const PointT& key) const
+    {
+        return !nodes.empty() && searchRec(0, key);
+    }
+
+    int getHeightRec(uint32_t index) const
+    {
+        const BoxNode& box = nodes[index];
+        if (box.right == NONE) return 1;
+        return 1 + max(getHeightRec(index + 1), getHeightRec(box.right));
+    }
+
+    int getHeight() const {return nodes.empty() ? 0 : getHeightRec(0);}
+
+    int getSize() const {return pts.size();}
+
+    size_t memoryUsage() const
+    {
+        return nodes.capacity()*sizeof(BoxNode) + pts.capacity()*sizeof(PointT) + coords.capacity()*sizeof(T);
+    }
+
+    //////////// find Point in an optimal distance
+    void closePointRec(vector<PointT>& arr, T maxDis, uint32_t index, const PointT& key) const
+    {
+        const BoxNode& box = nodes[index];
+        STATS_ADD(NODES_VISITED, 1);
+        if (boxDistance(box, key) > maxDis*maxDis) return;
+        // the whole box is in the ball, take all points without computing their distances
+        if (boxFarDistance(box, key) <= maxDis*maxDis) {
+            arr.insert(arr.end(), pts.begin() + box.begin, pts.begin() + box.end);
+            return;
+        }
+        if (box.right == NONE) {
+            T dis[MAXLEAF];
+            leafDistances(box, key, dis);
+            for (uint32_t j=0; j<box.end - box.begin; j++)
+                if (dis[j] <= maxDis*maxDis) arr.push_back(pts[box.begin + j]);
+            return;
+        }
+        closePointRec(arr, maxDis, index + 1, key);
+        closePointRec(arr, maxDis, box.right, key);
+    }
+
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0) const
+    {
+        vector<PointT> arr;
+        if (!nodes.empty()) closePointRec(arr, maxDis, 0, key);
+        STATS_ADD(QUERIES, 1);
+        return arr;
+    }
+
+    /////////// find the nearest Point, visit the child with the nearer box first
+    void nearestPointRec(uint32_t index, const PointT& key, uint32_t& best, T& bestDis) const
+    {
+        const BoxNode& box = nodes[index];
+        STATS_ADD(NODES_VISITED, 1);
+        if (box.right == NONE) {
+            T dis[MAXLEAF];
+            leafDistances(box, key, dis);
+            for (uint32_t j=0; j<box.end - box.begin; j++) {
+                if (dis[j] < bestDis) {
+                    bestDis = dis[j];
+                    best = box.begin + j;
+                }
+            }
+            return;
+        }
+        uint32_t near = index + 1, far = box.right;
+        T nearDis = boxDistance(nodes[near], key), farDis = boxDistance(nodes[far], key);
+        if (farDis < nearDis) {
+            swap(near, far);
+            swap(nearDis, farDis);
+        }
+        if (nearDis < bestDis) nearestPointRec(near, key, best, bestDis);
+        if (farDis < bestDis) nearestPointRec(far, key, best, bestDis);
+    }
+
+    PointT nearestPoint(const PointT& key) const
+    {
+        if (pts.empty()) throw "empty tree";
+        uint32_t best = 0;
+        T bestDis = numeric_limits<T>::max();
+        nearestPointRec(0, key, best, bestDis);
+        STATS_ADD(QUERIES, 1);
+        return pts[best];
+    }
+
+    /////////// find k nearest Points
+    void kNearestRec(KNearestHeap<PointT>& heap, uint32_t index, const PointT& key) const
+    {
+        const BoxNode& box = nodes[index];
+        STATS_ADD(NODES_VISITED, 1);
+        if (box.right == NONE) {
+            T dis[MAXLEAF];
+            leafDistances(box, key, dis);
+            for (uint32_t j=0; j<box.end - box.begin; j++) heap.push(dis[j], &pts[box.begin + j]);
+            return;
+        }
+        uint32_t near = index + 1, far = box.right;
+        T nearDis = boxDistance(nodes[near], key), farDis = boxDistance(nodes[far], key);
+        if (farDis < nearDis) {
+            swap(near, far);
+            swap(nearDis, farDis);
+        }
+        if (nearDis < heap.worst()) kNearestRec(heap, near, key);
+        if (farDis < heap.worst()) kNearestRec(heap, far, key);
+    }
+
+    vector<PointT> kNearest(const PointT& key, size_t kn) const
+    {
+        KNearestHeap<PointT> heap(kn);
+        if (!nodes.empty()) kNearestRec(heap, 0, key);
+        STATS_ADD(QUERIES, 1);
+        return heap.sorted();
+    }
+};
+
+#endif // BOXKDTREE_H
@@ -0,0 +1,393 @@
+#ifndef CONCURRENTINDEX_H
+#define CONCURRENTINDEX_H
+
+#include "point&plane.h"
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+////// an index that many threads can query while one thread inserts and removes points, readers never take a lock.
+////// The points are in immutable segments (KDTree, LSH, ...) plus a small append-only delta scanned by brute force.
+////// A full delta becomes a new segment and segments of similar size are merged (logarithmic method), so an insert
+////// costs O(log^2 N) amortized. Removed points are tombstones until the next full merge.
+////// Every change of segments or tombstones publishes a new version, readers keep the version they started with.
+////// Index must have kNearest(key, kn), closePoint(key, maxDis), countInRadius(key, maxDis) and forEachPoint(visit)
+template<class Index, int D = 3, class T = float>
+class ConcurrentIndex
+{
+    typedef Point<D, T> PointT;
+public:
+    typedef function<shared_ptr<const Index>(vector<PointT>&&)> Builder;
+private:
+    ////// points inserted since the last new segment, the writer fills pts[count] before count is increased
+    struct Delta
+    {
+        unique_ptr<PointT[]> pts;
+        size_t capacity;
+        atomic<size_t> count{0};
+        Delta(size_t capacity) : pts(new PointT[capacity]), capacity(capacity) {}
+    };
+
+    ////// removed copies of points, sorted by their coordinates
+    struct Tombstone
+    {
+        PointT point;
+        uint32_t removed; // number of removed copies
+        uint32_t alive; // number of copies left in the segments and the delta
+    };
+
+    ////// the tombstones in sorted chunks of at most 2*CHUNK entries. Versions share the chunks, a change copies the
+    ////// list of chunks and the one chunk it edits, not all tombstones
+    struct Tombstones
+    {
+        static const size_t CHUNK = 256;
+        typedef vector<Tombstone> Chunk;
+        vector<shared_ptr<const Chunk>> chunks; // none is empty, the points of a chunk are before those of the next
+        size_t removed = 0; // sum of removed of all entries
+
+        static bool less(const PointT& a, const PointT& b)
+        {
+            for (int u=0; u<D; u++) {
+                if (a[u] < b[u]) return 1;
+                if (b[u] < a[u]) return 0;
+            }
+            return 0;
+        }
+
+        static typename Chunk::const_iterator lowerBound(const Chunk& chunk, const PointT& p)
+        {
+            return lower_bound(chunk.begin(), chunk.end(), p, [](const Tombstone& e, const PointT& x) {return less(e.point, x);});
+        }
+
+        ////// the chunk which holds p or where p would be inserted
+        size_t chunkOf(const PointT& p) const
+        {
+            auto it = upper_bound(chunks.begin(), chunks.end(), p,
+                                  [](const PointT& x, const shared_ptr<const Chunk>& c) {return less(x, c->front().point);});
+            return (it == chunks.begin()) ? 0 : it - chunks.begin() - 1;
+        }
+
+        const Tombstone* find(const PointT& p) const
+        {
+            if (chunks.empty()) return nullptr;
+            const Chunk& chunk = *chunks[chunkOf(p)];
+            auto it = lowerBound(chunk, p);
+            return (it != chunk.end() && it->point == p) ? &*it : nullptr;
+        }
+
+        ////// a copy of chunk c this version can change, the other versions keep the old one
+        Chunk& edit(size_t c)
+        {
+            shared_ptr<Chunk> copy(new Chunk(*chunks[c]));
+            chunks[c] = copy;
+            return *copy;
+        }
+
+        ////// change the entry of p with change(entry), it is dropped when it has no removed copy left
+        template<class F>
+        void update(const PointT& p, F change)
+        {
+            size_t c = chunkOf(p);
+            Chunk& chunk = edit(c);
+            typename Chunk::iterator it = chunk.begin() + (lowerBound(chunk, p) - chunk.begin());
+            removed -= it->removed;
+            change(*it);
+            removed += it->removed;
+            if (it->removed == 0) chunk.erase(it);
+            if (chunk.empty()) chunks.erase(chunks.begin() + c);
+        }
+
+        void add(const Tombstone& e)
+        {
+            removed += e.removed;
+            if (chunks.empty()) {
+                chunks.push_back(shared_ptr<const Chunk>(new Chunk(1, e)));
+                return;
+            }
+            size_t c = chunkOf(e.point);
+            Chunk& chunk = edit(c);
+            chunk.insert(chunk.begin() + (lowerBound(chunk, e.point) - chunk.begin()), e);
+            if (chunk.size() > 2*CHUNK) {
+                shared_ptr<const Chunk> upper(new Chunk(chunk.begin() + CHUNK, chunk.end()));
+                chunk.resize(CHUNK);
+                chunks.insert(chunks.begin() + c + 1, upper);
+            }
+        }
+
+        ////// call visit(entry) for the entries whose first coordinate is in [lo, hi]
+        template<class F>
+        void forEachFirstIn(T lo, T hi, F visit) const
+        {
+            for (const auto& chunk : chunks) {
+                if (chunk->back().point[0] < lo) continue;
+                if (chunk->front().point[0] > hi) break;
+                auto it = lower_bound(chunk->begin(), chunk->end(), lo, [](const Tombstone& e, T x) {return e.point[0] < x;});
+                for (; it != chunk->end() && it->point[0] <= hi; it++) visit(*it);
+            }
+        }
+    };
+
+    struct Version
+    {
+        vector<shared_ptr<const Index>> segments; // largest first
+        vector<size_t> sizes; // number of points of every segment, removed copies included
+        shared_ptr<Delta> delta;
+        shared_ptr<const Tombstones> dead;
+    };
+
+    Builder builder;
+    size_t deltaCapacity;
+    shared_ptr<const Version> current; // read and written with atomic_load and atomic_store
+    mutex writerMtx; // writers are serialized, readers never lock it
+
+    shared_ptr<const Version> acquire() const {return atomic_load(&current);}
+
+    void publish(shared_ptr<const Version> v) {atomic_store(&current, v);}
+
+    ////// the query sees the delta points [0, count) of its version
+    static size_t deltaCount(const Version& v) {return v.delta->count.load(memory_order_acquire);}
+
+    ////// candidates sorted by distance, the first removed copies of every tombstoned point are skipped
+    static vector<PointT> filter(vector<pair<T, PointT>>& cand, const Tombstones& dead, size_t kn)
+    {
+        sort(cand.begin(), cand.end(), [](const pair<T, PointT>& a, const pair<T, PointT>& b) {return a.first < b.first;});
+        vector<PointT> res;
+        vector<pair<const Tombstone*, uint32_t>> skipped; // copies skipped so far of every tombstone
+        for (auto& c : cand) {
+            if (res.size() >= kn) break;
+            const Tombstone* t = dead.find(c.second);
+            if (t) {
+                auto it = find_if(skipped.begin(), skipped.end(), [t](const pair<const Tombstone*, uint32_t>& s) {return s.first == t;});
+                if (it == skipped.end()) {
+                    skipped.push_back(make_pair(t, 0));
+                    it = skipped.end() - 1;
+                }
+                if (it->second < t->removed) {
+                    it->second++;
+                    continue;
+                }
+            }
+            res.push_back(c.second);
+        }
+        return res;
+    }
+
+    shared_ptr<const Index> merge(const vector<shared_ptr<const Index>>& parts, vector<PointT>&& extra)
+    {
+        vector<PointT> points = move(extra);
+        for (auto& part : parts) part->forEachPoint([&](const PointT& p) {points.push_back(p);});
+        return builder(move(points));
+    }
+
+    ////// turn the delta of v into a segment and merge the segments while the last one is not smaller than
+    ////// half of the one before it, with the new empty delta
+    shared_ptr<Version> flush(const Version& v)
+    {
+        shared_ptr<Version> next(new Version(v));
+        size_t count = deltaCount(v);
+        if (count > 0) {
+            vector<PointT> points(v.delta->pts.get(), v.delta->pts.get() + count);
+            next->segments.push_back(builder(move(points)));
+            next->sizes.push_back(count);
+            while (next->segments.size() >= 2 && 2*next->sizes.back() >= next->sizes[next->sizes.size() - 2]) {
+                size_t last = next->segments.size() - 1;
+                auto merged = merge({next->segments[last - 1], next->segments[last]}, vector<PointT>());
+                next->sizes[last - 1] += next->sizes[last];
+                next->segments[last - 1] = merged;
+                next->segments.pop_back();
+                next->sizes.pop_back();
+            }
+        }
+        next->delta.reset(new Delta(deltaCapacity));
+        return next;
+    }
+public:
+    ConcurrentIndex(Builder builder, vector<PointT>&& points = vector<PointT>(), size_t deltaCapacity = 1024)
+        : builder(builder), deltaCapacity(max<size_t>(1, deltaCapacity))
+    {
+        shared_ptr<Version> v(new Version());
+        if (!points.empty()) {
+            v->sizes.push_back(points.size());
+            v->segments.push_back(builder(move(points)));
+        }
+        v->delta.reset(new Delta(this->deltaCapacity));
+        v->dead.reset(new Tombstones());
+        publish(v);
+    }
+
+    ConcurrentIndex(const ConcurrentIndex&) = delete;
+    ConcurrentIndex& operator=(const ConcurrentIndex&) = delete;
+
+    ////// number of live points
+    size_t getSize() const
+    {
+        shared_ptr<const Version> v = acquire();
+        size_t total = deltaCount(*v);
+        for (size_t s : v->sizes) total += s;
+        return total - v->dead->removed;
+    }
+
+    size_t numSegments() const {return acquire()->segments.size();}
+
+    //////////////// writer, one call at a time is running, readers go on with their versions
+    void insert(const PointT& p)
+    {
+        lock_guard<mutex> lock(writerMtx);
+        shared_ptr<const Version> v = acquire();
+        if (v->dead->find(p)) {
+            // a removed copy of p comes back, nothing is appended
+            shared_ptr<Tombstones> dead(new Tombstones(*v->dead));
+            dead->update(p, [](Tombstone& e) {
+                e.removed--;
+                e.alive++;
+            });
+            shared_ptr<Version> next(new Version(*v));
+            next->dead = dead;
+            publish(next);
+            return;
+        }
+        Delta& delta = *v->delta;
+        size_t count = delta.count.load(memory_order_relaxed);
+        if (count < delta.capacity) {
+            delta.pts[count] = p;
+            delta.count.store(count + 1, memory_order_release);
+            return;
+        }
+        shared_ptr<Version> next = flush(*v);
+        next->delta->pts[0] = p;
+        next->delta->count.store(1, memory_order_relaxed);
+        publish(next);
+    }
+
+    ////// remove one copy of p, return 0 if there is none
+    bool remove(const PointT& p)
+    {
+        lock_guard<mutex> lock(writerMtx);
+        shared_ptr<const Version> v = acquire();
+        shared_ptr<Tombstones> dead(new Tombstones(*v->dead));
+        const Tombstone* t = v->dead->find(p);
+        if (t) {
+            if (t->alive == 0) return 0;
+            dead->update(p, [](Tombstone& e) {
+                e.removed++;
+                e.alive--;
+            });
+        }
+        else {
+            // all copies of p, a tombstone keeps how many of them are left
+            size_t copies = 0;
+            for (auto& segment : v->segments) copies += segment->countInRadius(p, 0);
+            size_t count = deltaCount(*v);
+            for (size_t i=0; i<count; i++) copies += (v->delta->pts[i] == p);
+            if (copies == 0) return 0;
+            dead->add(Tombstone{p, 1, uint32_t(copies - 1)});
+        }
+        shared_ptr<Version> next(new Version(*v));
+        next->dead = dead;
+        publish(next);
+        // tombstones make queries ask for more points, a full merge drops them. Merging when they are a quarter of
+        // the live points pays the O(N log N) merge with N/4 removes, whatever the size of the index
+        if (dead->removed > max(deltaCapacity, getSize()/4)) mergeLocked();
+        return 1;
+    }
+
+    ////// merge all segments and the delta into one segment without the removed points
+    void merge()
+    {
+        lock_guard<mutex> lock(writerMtx);
+        mergeLocked();
+    }
+
+    void mergeLocked()
+    {
+        shared_ptr<const Version> v = acquire();
+        vector<PointT> points(v->delta->pts.get(), v->delta->pts.get() + deltaCount(*v));
+        for (auto& segment : v->segments) segment->forEachPoint([&](const PointT& p) {points.push_back(p);});
+        if (!v->dead->chunks.empty()) {
+            // drop the removed copies of every tombstone
+            unordered_map<const Tombstone*, uint32_t> skipped;
+            size_t j = 0;
+            for (size_t i=0; i<points.size(); i++) {
+                const Tombstone* t = v->dead->find(points[i]);
+                if (t && skipped[t]++ < t->removed) continue;
+                points[j++] = points[i];
+            }
+            points.resize(j);
+        }
+        shared_ptr<Version> next(new Version());
+        if (!points.empty()) {
+            next->sizes.push_back(points.size());
+            next->segments.push_back(builder(move(points)));
+        }
+        next->delta.reset(new Delta(deltaCapacity));
+        next->dead.reset(new Tombstones());
+        publish(next);
+    }
+
+    //////////////// readers, they can run in any number of threads at the same time as the writer
+    vector<PointT> kNearest(const PointT& key, size_t kn) const
+    {
+        shared_ptr<const Version> v = acquire();
+        const Tombstones& dead = *v->dead;
+        size_t count = deltaCount(*v);
+        // removed copies may be among the nearest points of a segment, then ask again for more
+        for (size_t want = kn; ; want = min(2*want, kn + dead.removed)) {
+            vector<pair<T, PointT>> cand;
+            T bound = numeric_limits<T>::max(); // the points not returned by a segment are not closer than bound
+            for (auto& segment : v->segments) {
+                vector<PointT> part = segment->kNearest(key, want);
+                for (const PointT& p : part) cand.push_back(make_pair(key.squareDistance(p), p));
+                if (part.size() == want && want > 0) bound = min(bound, key.squareDistance(part.back()));
+            }
+            for (size_t i=0; i<count; i++) cand.push_back(make_pair(key.squareDistance(v->delta->pts[i]), v->delta->pts[i]));
+            vector<PointT> res = filter(cand, dead, kn);
+            if (want >= kn + dead.removed || (res.size() == kn && (kn == 0 || key.squareDistance(res.back()) <= bound)))
+                return res;
+        }
+    }
+
+    PointT nearestPoint(const PointT& key) const
+    {
+        vector<PointT> res = kNearest(key, 1);
+        if (res.empty()) throw "empty index";
+        return res[0];
+    }
+
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0) const
+    {
+        shared_ptr<const Version> v = acquire();
+        vector<pair<T, PointT>> cand;
+        for (auto& segment : v->segments)
+            for (const PointT& p : segment->closePoint(key, maxDis)) cand.push_back(make_pair(key.squareDistance(p), p));
+        size_t count = deltaCount(*v);
+        for (size_t i=0; i<count; i++) {
+            T dis = key.squareDistance(v->delta->pts[i]);
+            if (dis <= maxDis*maxDis) cand.push_back(make_pair(dis, v->delta->pts[i]));
+        }
+        return filter(cand, *v->dead, numeric_limits<size_t>::max());
+    }
+
+    size_t countInRadius(const PointT& key, T maxDis) const
+    {
+        shared_ptr<const Version> v = acquire();
+        size_t total = 0;
+        for (auto& segment : v->segments) total += segment->countInRadius(key, maxDis);
+        size_t count = deltaCount(*v);
+        for (size_t i=0; i<count; i++) total += key.squareDistance(v->delta->pts[i]) <= maxDis*maxDis;
+        // all copies of a point are at the same place, they are in the distance together.
+        // Tombstones are sorted by the first coordinate first, only those in [key[0] - maxDis, key[0] + maxDis] are checked
+        v->dead->forEachFirstIn(key[0] - maxDis, key[0] + maxDis, [&](const Tombstone& e) {
+            if (key.squareDistance(e.point) <= maxDis*maxDis) total -= min<size_t>(total, e.removed);
+        });
+        return total;
+    }
+};
+
+#endif // CONCURRENTINDEX_H
@@ -0,0 +1,199 @@
+#ifndef FLATKDTREE_H
+#define FLATKDTREE_H
+
+#include "point&plane.h"
+#include "Snapshot.h"
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <float.h>
+#include <algorithm>
+
+using namespace std;
+
+////// static KD Tree stored in one contiguous array, no Node and no pointer
+////// the subtree of range [lo, hi) has its root at mid = lo + (hi - lo)/2,
+////// left subtree is [lo, mid) and right subtree is [mid + 1, hi)
+template<int D = 3, class T = float>
+class FlatKDTree
+{
+    typedef Point<D, T> PointT;
+    vector<PointT> pts; // points are copied into the tree in the order of the implicit layout
+    // the array used by queries, pts or the points of a mapped snapshot
+    const PointT* data = nullptr;
+    size_t count = 0;
+    shared_ptr<const Snapshot> snapshot;
+    static const int k = D; // k is the number of dimension
+public:
+    FlatKDTree() {}
+    FlatKDTree(const vector<PointT>& points) {build(points);}
+    FlatKDTree(vector<PointT>&& points) {build(move(points));}
+    FlatKDTree(const FlatKDTree&) = delete; // data points into pts or into the snapshot of this tree
+    FlatKDTree& operator=(const FlatKDTree&) = delete;
+
+    ////// arrange points so that the median of each range is its root
+    void buildRec(size_t lo, size_t hi, int depth)
+    {
+        if (lo >= hi) return;
+        int d = depth%k;
+        size_t mid = lo + (hi - lo)/2;
+        nth_element(pts.begin() + lo, pts.begin() + mid, pts.begin() + hi,
+                    [d](const PointT& a, const PointT& b) {return a[d] < b[d];});
+        buildRec(lo, mid, depth + 1);
+        buildRec(mid + 1, hi, depth + 1);
+    }
+
+    void build(const vector<PointT>& points)
+    {
+        clear();
+        pts = points;
+        buildRec(0, pts.size(), 0);
+        data = pts.data();
+        count = pts.size();
+    }
+
+    void build(vector<PointT>&& points) ////// the points are moved into the tree without copying
+    {
+        clear();
+        pts = move(points);
+        buildRec(0, pts.size(), 0);
+        data = pts.data();
+        count = pts.size();
+    }
+
+    void clear()
+    {
+        vector<PointT>().swap(pts);
+        data = nullptr;
+        count = 0;
+        snapshot.reset();
+    }
+
+    ////// write the tree to a snapshot, the array is already in the implicit layout
+    void save(const string& path) const
+    {
+        SnapshotWriter out(path, SNAPSHOT_FLATKDTREE, D, sizeof(T));
+        out.section(data, count*sizeof(PointT));
+        out.finish();
+    }
+
+    ////// use the points of a snapshot in place, nothing is built or copied
+    void load(const string& path)
+    {
+        shared_ptr<const Snapshot> s = Snapshot::open(path, SNAPSHOT_FLATKDTREE, D, sizeof(T));
+        size_t num = s->count<PointT>(0);
+        clear();
+        data = s->array<PointT>(0, num);
+        count = num;
+        snapshot = s;
+    }
+
+
+    ////// exactly search, points equal to the split value may be on both sides
+    bool searchRec(size_t lo, size_t hi, const PointT& key, int depth) const
+    {
+        if (lo >= hi) return 0;
+        size_t mid = lo + (hi - lo)/2;
+        if (data[mid] == key) return 1;
+        int d = depth%k;
+        if (key[d] < data[mid][d]) return searchRec(lo, mid, key, depth + 1);
+        else if (key[d] > data[mid][d]) return searchRec(mid + 1, hi, key, depth + 1);
+        else return searchRec(lo, mid, key, depth + 1) || searchRec(mid + 1, hi, key, depth + 1);
+    }
+
+    bool search(const PointT& key) const
+    {
+        return searchRec(0, count, key, 0);
+    }
+
+    int getHeight() const
+    {
+        int h = 0;
+        for (size_t n = count; n > 0; n /= 2) h++;
+        return h;
+    }
+
+    int getSize() const {return count;}
+
+    size_t memoryUsage() const {return pts.capacity()*sizeof(PointT);} // a mapped snapshot is not counted
+
+    //////////// find Point in an optimal distance
+    void closePointRec(vector<PointT>& arr, T maxDis, size_t lo, size_t hi, const PointT& key, int depth) const
+    {
+        if (lo >= hi) return;
+        size_t mid = lo + (hi - lo)/2;
+        int d = depth%k;
+        if (key.squareDistance(data[mid]) <= maxDis*maxDis)
+            arr.push_back(data[mid]);
+        T diff = key[d] - data[mid][d];
+        // only go to the side of the divided plane which is closer than the arguement distance
+        if (diff <= maxDis) closePointRec(arr, maxDis, lo, mid, key, depth + 1);
+        if (-diff <= maxDis) closePointRec(arr, maxDis, mid + 1, hi, key, depth + 1);
+    }
+
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0) const
+    {
+        vector<PointT> arr;
+        closePointRec(arr, maxDis, 0, count, key, 0);
+        return arr;
+    }
+
+    /////////// find the nearest Point, return its index in the array
+    void nearestPointRec(size_t lo, size_t hi, const PointT& key, int depth, size_t& best, T& bestDis) const
+    {
+        if (lo >= hi) return;
+        size_t mid = lo + (hi - lo)/2;
+        int d = depth%k;
+        T dis = key.squareDistance(data[mid]);
+        if (dis < bestDis) {
+            bestDis = dis;
+            best = mid;
+        }
+        T diff = key[d] - data[mid][d];
+        // visit the side which contains key first, then the other side if the divided plane is closer than the best point
+        if (diff < 0) {
+            nearestPointRec(lo, mid, key, depth + 1, best, bestDis);
+            if (diff*diff < bestDis) nearestPointRec(mid + 1, hi, key, depth + 1, best, bestDis);
+        }
+        else {
+            nearestPointRec(mid + 1, hi, key, depth + 1, best, bestDis);
+            if (diff*diff < bestDis) nearestPointRec(lo, mid, key, depth + 1, best, bestDis);
+        }
+    }
+
+    PointT nearestPoint(const PointT& key) const
+    {
+        if (count == 0) throw "empty tree";
+        size_t best = 0;
+        T bestDis = numeric_limits<T>::max();
+        nearestPointRec(0, count, key, 0, best, bestDis);
+        return data[best];
+    }
+
+    /////////// find k nearest Points
+    void kNearestRec(KNearestHeap<PointT>& heap, size_t lo, size_t hi, const PointT& key, int depth) const
+    {
+        if (lo >= hi) return;
+        size_t mid = lo + (hi - lo)/2;
+        int d = depth%k;
+        heap.push(key.squareDistance(data[mid]), &data[mid]);
+        T diff = key[d] - data[mid][d];
+        if (diff < 0) {
+            kNearestRec(heap, lo, mid, key, depth + 1);
+            if (diff*diff < heap.worst()) kNearestRec(heap, mid + 1, hi, key, depth + 1);
+        }
+        else {
+            kNearestRec(heap, mid + 1, hi, key, depth + 1);
+            if (diff*diff < heap.worst()) kNearestRec(heap, lo, mid, key, depth + 1);
+        }
+    }
+
+    vector<PointT> kNearest(const PointT& key, size_t kn) const
+    {
+        KNearestHeap<PointT> heap(kn);
+        kNearestRec(heap, 0, count, key, 0);
+        return heap.sorted();
+    }
+};
+
+#endif // FLATKDTREE_H
@@ -2,6 +2,11 @@
 #define KDTREE_H
 
 #include "point&plane.h"
+#include "ThreadPool.h"
+#include "PointStore.h"
+#include "Snapshot.h"
+#include "QueryStats.h"
+#include "SpaceFillingCurve.h"
 #include <iostream>
 #include <vector>
 #include <cmath>
@@ -11,65 +16,260 @@
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <algorithm>
+#include <thread>
 
 using namespace std;
 
 class Node
 {
-    friend class KDTree;
-    const Point3D* data;
+    template<int, class> friend class KDTree;
+    uint32_t id; // id of the point in the store of the tree
+    uint32_t size = 1; // number of nodes in the subtree of this node
     Node* left = nullptr;
     Node* right = nullptr;
 public:
-    Node(const Point3D& data, Node* left = nullptr, Node* right = nullptr) : left(left), right(right)
-    {
-        this->data = &data;
-    }
+    Node(uint32_t id, Node* left = nullptr, Node* right = nullptr) : id(id), left(left), right(right) {}
 };
 
+////// KD Tree of points with D coordinates of type T. No point of the left subtree of a node is larger than the node
+////// on its dimension and no point of the right subtree is smaller, points equal to the node may be on both sides
+template<int D = 3, class T = float>
 class KDTree
 {
+    typedef Point<D, T> PointT;
     Node* root = nullptr;
-    const int k = 3; // k is the number of dimension
+    PointStore<PointT> store; // the tree owns its points, nodes only keep their ids
+    shared_ptr<const Snapshot> snapshot; // the points of a loaded tree may be in this snapshot
+    // scapegoat rebalancing: a subtree is rebuilt when an insert goes deeper than log(maxSize)/log(1/alpha),
+    // the whole tree is rebuilt when removes make it smaller than alpha*maxSize
+    double alpha = 0.75;
+    size_t maxSize = 0; // the largest size since the last rebuild of the whole tree
+    size_t rebuilt = 0; // number of nodes rebuilt by rebalancing
+    CurveKind curve = CURVE_NONE; // order of the points in the store after build and insertBatch
+    static const int k = D; // k is the number of dimension
+
+    const PointT& point(const Node* node) const {return store[node->id];}
 public:
-    /////// clear tree
+    /////// clear tree, without recursion so a deep tree built with rebalancing off cannot overflow the stack
     void clear(Node* node)
     {
-        if (node) {
-            clear(node->left);
-            clear(node->right);
-            delete node;
+        vector<Node*> stack;
+        if (node) stack.push_back(node);
+        while (!stack.empty()) {
+            Node* x = stack.back();
+            stack.pop_back();
+            if (x->left) stack.push_back(x->left);
+            if (x->right) stack.push_back(x->right);
+            delete x;
         }
     }
 
+    void clear()
+    {
+        clear(root);
+        root = nullptr;
+        store.clear();
+        snapshot.reset();
+        maxSize = 0;
+        rebuilt = 0;
+    }
+
+    KDTree() {}
+    KDTree(const vector<PointT>& points, int numThreads = 1) {build(points, numThreads);}
+    KDTree(vector<PointT>&& points, int numThreads = 1) {build(move(points), numThreads);}
+    KDTree(const KDTree&) = delete;
+    KDTree& operator=(const KDTree&) = delete;
     ~KDTree(){clear(root);}
 
-    ////// insert node
-    Node* insertRec(Node* node, const Point3D& ndata, int depth)
+    ////// bulk build a balanced tree, the median of each dimension is the root of subtree, always O(NlogN).
+    ////// Points equal to the median may be on both sides, so the halves differ by at most one point even with
+    ////// many equal points and the recursion is never deeper than log2(N) + 1
+    Node* buildRec(vector<uint32_t>& arr, size_t lo, size_t hi, int depth, int numThreads)
     {
-        if (!node) return new Node(ndata);
+        if (lo >= hi) return nullptr;
         int d = depth%k;
-        if (ndata[d] < (*node->data)[d]) node->left = insertRec(node->left, ndata, depth + 1);
-        else node->right = insertRec(node->right, ndata, depth + 1);
+        size_t mid = lo + (hi - lo)/2;
+        auto less = [this, d](uint32_t a, uint32_t b) {return store[a][d] < store[b][d];};
+        nth_element(arr.begin() + lo, arr.begin() + mid, arr.begin() + hi, less);
+        Node* node = new Node(arr[mid]);
+        node->size = hi - lo;
+        if (numThreads > 1) {
+            // build two subtrees in parallel, each side gets half of the threads
+            thread leftBuilder([&]() {node->left = buildRec(arr, lo, mid, depth + 1, numThreads/2);});
+            node->right = buildRec(arr, mid + 1, hi, depth + 1, numThreads - numThreads/2);
+            leftBuilder.join();
+        }
+        else {
+            node->left = buildRec(arr, lo, mid, depth + 1, 1);
+            node->right = buildRec(arr, mid + 1, hi, depth + 1, 1);
+        }
         return node;
     }
 
-    void insert(const Point3D& ndata)
+    ////// the points are copied into the tree
+    void build(const vector<PointT>& points, int numThreads = 1)
+    {
+        build(vector<PointT>(points), numThreads);
+    }
+
+    ////// the points are moved into the tree without copying
+    void build(vector<PointT>&& points, int numThreads = 1)
+    {
+        clear();
+        sortByCurve(points, curve);
+        store.assign(move(points));
+        vector<uint32_t> arr(store.size());
+        for (uint32_t i=0; i<store.size(); i++) arr[i] = i;
+        root = buildRec(arr, 0, arr.size(), 0, numThreads);
+        maxSize = arr.size();
+    }
+
+    ////// rebalancing is off if alpha is 1, a smaller alpha keeps the tree lower with more rebuilds
+    void setAlpha(double alpha)
+    {
+        if (alpha < 0.5 || alpha > 1) throw "alpha is out of range";
+        this->alpha = alpha;
+    }
+
+    double getAlpha() const {return alpha;}
+
+    ////// store the points along a space filling curve, so the points of a subtree are close in memory,
+    ////// takes effect at the next build
+    void setCurve(CurveKind curve) {this->curve = curve;}
+    CurveKind getCurve() const {return curve;}
+
+    ////// number of nodes rebuilt by rebalancing since the last build or clear, the amortized cost of updates
+    size_t rebuiltNodes() const {return rebuilt;}
+
+    ////// rebuild the subtree at link balanced, its root is at depth
+    void rebuild(Node** link, int depth)
+    {
+        vector<uint32_t> arr;
+        vector<Node*> stack;
+        if (*link) stack.push_back(*link);
+        while (!stack.empty()) {
+            Node* node = stack.back();
+            stack.pop_back();
+            arr.push_back(node->id);
+            if (node->left) stack.push_back(node->left);
+            if (node->right) stack.push_back(node->right);
+            delete node;
+        }
+        *link = buildRec(arr, 0, arr.size(), depth, 1);
+        rebuilt += arr.size();
+    }
+
+    ////// write the tree to a snapshot: the points in preorder, then one byte per node,
+    ////// bit 0 is set if the node has a left child and bit 1 if it has a right child
+    void save(const string& path) const
     {
-        this->root = insertRec(root, ndata, 0);
+        SnapshotWriter out(path, SNAPSHOT_KDTREE, D, sizeof(T));
+        vector<uint8_t> shape;
+        vector<const Node*> stack;
+        if (root) stack.push_back(root);
+        out.beginSection();
+        while (!stack.empty()) {
+            const Node* node = stack.back();
+            stack.pop_back();
+            out.write(&point(node), sizeof(PointT));
+            shape.push_back((node->left ? 1 : 0) | (node->right ? 2 : 0));
+            if (node->right) stack.push_back(node->right);
+            if (node->left) stack.push_back(node->left);
+        }
+        out.section(shape.data(), shape.size());
+        out.finish();
+    }
+
+    ////// load a snapshot, the points are used in place and the nodes are linked again in O(N) without comparing points.
+    ////// Removed points of a loaded tree are not reused, inserted points are copied as usual
+    void load(const string& path)
+    {
+        shared_ptr<const Snapshot> s = Snapshot::open(path, SNAPSHOT_KDTREE, D, sizeof(T));
+        size_t num = s->count<PointT>(0);
+        const uint8_t* shape = s->array<uint8_t>(1, num);
+        clear();
+        store.map(s->array<PointT>(0, num), num);
+        snapshot = s;
+        // node i is the i-th node in preorder, its id is i
+        vector<Node**> links(1, &root);
+        vector<Node*> nodes(num);
+        for (uint32_t i=0; i<num; i++) {
+            if (links.empty()) throw "bad snapshot";
+            Node** link = links.back();
+            links.pop_back();
+            *link = nodes[i] = new Node(i);
+            if (shape[i] & 2) links.push_back(&(*link)->right);
+            if (shape[i] & 1) links.push_back(&(*link)->left);
+        }
+        if (!links.empty() && num > 0) throw "bad snapshot";
+        // children come after their parent in preorder
+        for (uint32_t i=num; i-->0;) {
+            if (nodes[i]->left) nodes[i]->size += nodes[i]->left->size;
+            if (nodes[i]->right) nodes[i]->size += nodes[i]->right->size;
+        }
+        maxSize = num;
     }
 
-    ////// exactly search, always O(logN)
-    bool searchRec(Node* node, const Point3D& key, int depth)
+    void insert(const PointT& ndata)
+    {
+        uint32_t id = store.add(ndata);
+        // walk down without recursion, the last links on the way are kept in a fixed ring to find a scapegoat
+        static const int PATHSIZE = 64;
+        Node** path[PATHSIZE];
+        Node** link = &root;
+        int depth = 0;
+        for (; *link; depth++) {
+            path[depth%PATHSIZE] = link;
+            (*link)->size++;
+            int d = depth%k;
+            if (ndata[d] < point(*link)[d]) link = &(*link)->left;
+            else link = &(*link)->right;
+        }
+        *link = new Node(id);
+        maxSize = max<size_t>(maxSize, root->size);
+        double logScale = log(1/alpha);
+        if (alpha >= 1 || depth <= log(maxSize)/logScale) return;
+        // the new node is too deep, rebuild the lowest ancestor whose height is too large for its size.
+        // The root always is one, an ancestor above the ring is found by walking down again
+        for (int i=depth-1; i>=max(0, depth - PATHSIZE); i--) {
+            if (depth - i > log((*path[i%PATHSIZE])->size)/logScale) {
+                rebuild(path[i%PATHSIZE], i);
+                return;
+            }
+        }
+        Node** scapegoat = &root;
+        int scapegoatDepth = 0;
+        link = &root;
+        for (int i=0; i<depth-PATHSIZE; i++) {
+            if (depth - i > log((*link)->size)/logScale) {
+                scapegoat = link;
+                scapegoatDepth = i;
+            }
+            if (ndata[i%k] < point(*link)[i%k]) link = &(*link)->left;
+            else link = &(*link)->right;
+        }
+        rebuild(scapegoat, scapegoatDepth);
+    }
+
+    ////// insert points in the order of the curve, so a batch is appended to the store as one run of near points
+    void insertBatch(const vector<PointT>& points)
+    {
+        for (uint32_t i : curveOrder(points, curve)) insert(points[i]);
+    }
+
+    ////// exactly search, points equal to the split value may be on both sides
+    bool searchRec(Node* node, const PointT& key, int depth) const
     {
         if (!node) return 0;
-        else if ((*node->data) == key) return 1;
+        else if (point(node) == key) return 1;
         int d = depth%k;
-        if (key[d] < (*node->data)[d]) return searchRec(node->left, key, depth + 1);
-        else return searchRec(node->right, key, depth + 1);
+        if (key[d] < point(node)[d]) return searchRec(node->left, key, depth + 1);
+        else if (key[d] > point(node)[d]) return searchRec(node->right, key, depth + 1);
+        else return searchRec(node->left, key, depth + 1) || searchRec(node->right, key, depth + 1);
     }
 
-    bool search(const Point3D& key)
+    bool search(const PointT& key) const
     {
         return searchRec(root, key, 0);
     }
@@ -80,79 +280,97 @@ public:
         if (!node) return nullptr;
         int cd = depth%k;
         if (cd == d) {
+            // no point of the left subtree is larger than node on d
             if (node->left) return findMinRec(node->left, d, depth + 1);
-            else return nullptr;
+            else return node;
         }
         Node* minl = findMinRec(node->left, d, depth + 1);
         Node* minr = findMinRec(node->right, d, depth + 1);
         Node* rnode = node;
-        if (minl && (*minl->data)[d] < (*rnode->data)[d]) rnode = minl;
-        if (minr && (*minr->data)[d] < (*rnode->data)[d]) rnode = minr;
+        if (minl && point(minl)[d] < point(rnode)[d]) rnode = minl;
+        if (minr && point(minr)[d] < point(rnode)[d]) rnode = minr;
         return rnode;
     }
 
-    Node* removeRec(Node* node, const Point3D& key, int depth)
+    ////// removedId is the id of the deleted node, the points of the ids moved up are equal to the removed points
+    Node* removeRec(Node* node, const PointT& key, int depth, uint32_t& removedId)
     {
         if (!node) return nullptr;
         int d = depth%k;
-        if ((*node->data) == key) {
+        if (point(node) == key) {
+            // the smallest point on d of a child moves up, then no point of the left subtree is larger than node
+            // and no point of the right subtree is smaller
             if (node->right) {
-                const Point3D* minr = findMinRec(node->right, d, depth + 1)->data;
-                node->data = minr;
-                node->right = removeRec(node->right, *minr, depth + 1);
+                PointT minr = point(findMinRec(node->right, d, depth + 1));
+                uint32_t movedId = PointStore<PointT>::NONE;
+                removedId = node->id;
+                node->right = removeRec(node->right, minr, depth + 1, movedId);
+                node->id = movedId;
             }
             else if (node->left) {
-                const Point3D* minl = findMinRec(node->left, d, depth + 1)->data;
-                node->data = minl;
-                node->right = removeRec(node->left, *minl, depth + 1);
+                PointT minl = point(findMinRec(node->left, d, depth + 1));
+                uint32_t movedId = PointStore<PointT>::NONE;
+                removedId = node->id;
+                node->right = removeRec(node->left, minl, depth + 1, movedId);
+                node->id = movedId;
                 node->left = nullptr;
             }
             else {
+                removedId = node->id;
                 delete node;
                 return nullptr;
             }
         }
         else {
-            if (key[d] < (*node->data)[d]) node->left = removeRec(node->left, key, depth + 1);
-            else node->right =  removeRec(node->right, key, depth + 1);
+            if (key[d] <= point(node)[d]) node->left = removeRec(node->left, key, depth + 1, removedId);
+            // a key equal to the split value which is not on the left may be on the right
+            if (key[d] >= point(node)[d] && removedId == PointStore<PointT>::NONE)
+                node->right = removeRec(node->right, key, depth + 1, removedId);
         }
+        // a node was deleted below, the removal of a moved point always finds it so removedId is set there too
+        if (removedId != PointStore<PointT>::NONE) node->size--;
         return node;
     }
 
-    void remove(const Point3D& key)
-    {
-        root = removeRec(root, key, 0);
-    }
-
-    int getHeightRec(Node* node)
+    void remove(const PointT& key)
     {
-        if (!node) return 0;
-        else {
-            int lh = getHeightRec(node->left), rh = getHeightRec(node->right);
-            return ((lh>rh)?lh:rh) + 1;
+        uint32_t removedId = PointStore<PointT>::NONE;
+        root = removeRec(root, key, 0, removedId);
+        if (removedId == PointStore<PointT>::NONE) return;
+        store.release(removedId);
+        if (!root) maxSize = 0;
+        else if (alpha < 1 && root->size < alpha*maxSize) {
+            rebuild(&root, 0);
+            maxSize = root->size;
         }
     }
 
-    int getHeight()
+    int getHeight() const
     {
-        return getHeightRec(root);
+        return depthHistogram().size();
     }
 
-    int getSizeRec(Node* node)
+    int getSize() const {return root ? root->size : 0;}
+
+    ////// call visit(point) for every point of the tree, in the order of their ids
+    template<class F>
+    void forEachPoint(F visit) const
     {
-        if (!node) return 0;
-        else return 1 + getSizeRec(node->left) + getSizeRec(node->right);
+        for (uint32_t id=0; id<store.size(); id++)
+            if (store.alive(id)) visit(store[id]);
     }
 
-    int getSize() {return getSizeRec(root);}
+    ////// bytes used by the nodes and the points
+    size_t memoryUsage() const {return getSize()*sizeof(Node) + store.memoryUsage();}
 
-    void printRec(Node* node, int level)
+    void printRec(Node* node, int level) const
     {
-        cout << char('x' + level%k) << ": ";
+        if (k <= 3) cout << char('x' + level%k) << ": ";
+        else cout << "x" << level%k << ": ";
         for (int i=0; i<level; i++) cout << "     ";
         cout << "[--->";
         if (node) {
-            cout << (*node->data) << endl;
+            cout << point(node) << endl;
             if (node->right) {
                 printRec(node->left, level + 1);
                 printRec(node->right, level + 1);
@@ -163,81 +381,301 @@ public:
         else cout << endl;
     }
 
-    //////////// find Point in an optimal distance
-    void closePointRec(vector<Point3D>& arr, float maxDis, Node* node, const Point3D& key, int depth)
+    //////////// range queries without copying: the cell of a node is the region its subtree can cover,
+    //////////// [lo, hi] on every dimension. A subtree whose cell is inside the region is visited without
+    //////////// checking its points, or counted at once by its size
+    struct Ball
+    {
+        const PointT& key;
+        T squareDis;
+        bool contains(const PointT& p) const {return key.squareDistance(p) <= squareDis;}
+        bool intersects(const T* lo, const T* hi) const
+        {
+            T dis = 0;
+            for (int u=0; u<D; u++) {
+                T diff = max(lo[u] - key[u], max(T(0), key[u] - hi[u]));
+                dis += diff*diff;
+            }
+            return dis <= squareDis;
+        }
+        bool inside(const T* lo, const T* hi) const // the farthest corner of the cell is in the ball
+        {
+            T dis = 0;
+            for (int u=0; u<D; u++) {
+                T diff = max(key[u] - lo[u], hi[u] - key[u]);
+                dis += diff*diff;
+                if (dis > squareDis) return 0;
+            }
+            return 1;
+        }
+    };
+
+    struct Box
+    {
+        const PointT& lo;
+        const PointT& hi;
+        bool contains(const PointT& p) const
+        {
+            for (int u=0; u<D; u++)
+                if (p[u] < lo[u] || p[u] > hi[u]) return 0;
+            return 1;
+        }
+        bool intersects(const T* clo, const T* chi) const
+        {
+            for (int u=0; u<D; u++)
+                if (chi[u] < lo[u] || clo[u] > hi[u]) return 0;
+            return 1;
+        }
+        bool inside(const T* clo, const T* chi) const
+        {
+            for (int u=0; u<D; u++)
+                if (clo[u] < lo[u] || chi[u] > hi[u]) return 0;
+            return 1;
+        }
+    };
+
+    ////// visitPoint(point) for every point of node in region, except whole subtrees inside region go to visitSubtree(node)
+    template<class R, class F, class G>
+    void rangeRec(const Node* node, const R& region, int depth, T* lo, T* hi, F& visitPoint, G& visitSubtree) const
     {
         if (!node) return;
+        STATS_ADD(NODES_VISITED, 1);
+        if (!region.intersects(lo, hi)) return;
+        if (region.inside(lo, hi)) {
+            visitSubtree(node);
+            return;
+        }
+        if (region.contains(point(node))) visitPoint(point(node));
         int d = depth%k;
-        // if the distance between node and key is smaller than an arguement distance, inseer node into the return vector
-        if (key.squareDistance((*node->data)) <= maxDis*maxDis)
-            arr.push_back((*node->data));
-        if (key[d] < (*node->data)[d]) {
-            closePointRec(arr, maxDis, node->left, key, depth + 1);
-            // if the distance between key and the divided plane is smaller than an arguement, must check the other side
-            if (abs(key[d] - (*node->data)[d]) < maxDis)
-                closePointRec(arr, maxDis, node->right, key, depth + 1);
+        T split = point(node)[d];
+        // points smaller than split are on the left, the others on the right
+        T saved = hi[d];
+        hi[d] = min(saved, split);
+        rangeRec(node->left, region, depth + 1, lo, hi, visitPoint, visitSubtree);
+        hi[d] = saved;
+        saved = lo[d];
+        lo[d] = max(saved, split);
+        rangeRec(node->right, region, depth + 1, lo, hi, visitPoint, visitSubtree);
+        lo[d] = saved;
+    }
+
+    template<class R, class F>
+    void visitRange(const R& region, F visit) const
+    {
+        T lo[D], hi[D];
+        for (int u=0; u<D; u++) {
+            lo[u] = numeric_limits<T>::lowest();
+            hi[u] = numeric_limits<T>::max();
         }
-        else {
-            closePointRec(arr, maxDis, node->right, key, depth + 1);
-            // if the distance between key and the divided plane is smaller than an arguement, must check the other side
-            if (abs(key[d] - (*node->data)[d]) < maxDis)
-                closePointRec(arr, maxDis, node->left, key, depth + 1);
+        auto visitSubtree = [&](const Node* node) {
+            vector<const Node*> stack(1, node);
+            while (!stack.empty()) {
+                const Node* x = stack.back();
+                stack.pop_back();
+                visit(point(x));
+                if (x->left) stack.push_back(x->left);
+                if (x->right) stack.push_back(x->right);
+            }
+        };
+        rangeRec(root, region, 0, lo, hi, visit, visitSubtree);
+        STATS_ADD(QUERIES, 1);
+    }
+
+    template<class R>
+    size_t countRange(const R& region) const
+    {
+        T lo[D], hi[D];
+        for (int u=0; u<D; u++) {
+            lo[u] = numeric_limits<T>::lowest();
+            hi[u] = numeric_limits<T>::max();
         }
+        size_t count = 0;
+        auto countPoint = [&](const PointT&) {count++;};
+        auto countSubtree = [&](const Node* node) {count += node->size;};
+        rangeRec(root, region, 0, lo, hi, countPoint, countSubtree);
+        STATS_ADD(QUERIES, 1);
+        return count;
     }
 
-    vector<Point3D> closePoint(const Point3D& key, float maxDis = 0)
+    ////// call visit(point) for every point in the distance, a point exactly at maxDis is in it
+    template<class F>
+    void visitRadius(const PointT& key, T maxDis, F visit) const {visitRange(Ball{key, maxDis*maxDis}, visit);}
+
+    //////////// find Point in an optimal distance, the same points as visitRadius and countInRadius
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0) const
     {
-        vector<Point3D> arr;
-        closePointRec(arr, maxDis, root, key, 0);
+        vector<PointT> arr;
+        visitRadius(key, maxDis, [&](const PointT& p) {arr.push_back(p);});
         return arr;
     }
 
-    /////////// find the nearest Point
-    Point3D nearestPointRec(Node* node, const Point3D& key, int depth)
+    size_t countInRadius(const PointT& key, T maxDis) const {return countRange(Ball{key, maxDis*maxDis});}
+
+    ////// call visit(point) for every point in the box [lo, hi]
+    template<class F>
+    void visitBox(const PointT& lo, const PointT& hi, F visit) const {visitRange(Box{lo, hi}, visit);}
+
+    vector<PointT> boxQuery(const PointT& lo, const PointT& hi) const
     {
-        if (!node) throw "empty tree";
-        int d = depth%k;
-        Point3D nearPoint = (*node->data);
-        if (key[d] < (*node->data)[d]) {
-            if (node->left) {
-                // find the nearest point in the left subtree
-                Point3D nearPointLeft = nearestPointRec(node->left, key, depth + 1);
-                // compare which is smaller, the root point and the left subtree point
-                if (key.squareDistance(nearPointLeft) < key.squareDistance(nearPoint))
-                    nearPoint = nearPointLeft;
-            }
-            // if the distance between key and the divided plane is smaller, find the nearest point in the right subtree
-            if (node->right && (key[d] - (*node->data)[d])*(key[d] - (*node->data)[d]) < key.squareDistance(nearPoint)) {
-                Point3D nearPointRight = nearestPointRec(node->right, key, depth + 1);
-                if (key.squareDistance(nearPointRight) < key.squareDistance(nearPoint))
-                    nearPoint = nearPointRight;
+        vector<PointT> arr;
+        visitBox(lo, hi, [&](const PointT& p) {arr.push_back(p);});
+        return arr;
+    }
+
+    size_t countInBox(const PointT& lo, const PointT& hi) const {return countRange(Box{lo, hi});}
+
+    /////////// find the nearest Point without recursion
+    struct SearchItem
+    {
+        const Node* node;
+        int depth;
+        T planeDis; // square distance between key and the divided plane in front of node
+    };
+
+    ////// with epsilon > 0 the result is at most (1 + epsilon) times farther than the nearest point, a far side is only
+    ////// checked if it may hold a point that much nearer. maxVisits > 0 stops after that many nodes, then the result
+    ////// is the best point found so far without any guarantee
+    NearestResult<PointT> nearest(const PointT& key, T epsilon = 0, size_t maxVisits = 0) const
+    {
+        NearestResult<PointT> best;
+        T scale = 1/((1 + epsilon)*(1 + epsilon)); // the plane must be closer than best*scale
+        size_t budget = maxVisits ? maxVisits : numeric_limits<size_t>::max(), visits = 0;
+        // the far sides waiting to be checked, the fixed stack is enough for any balanced tree,
+        // only a degenerate tree built by insert can spill into the vector
+        static const int STACKSIZE = 64;
+        SearchItem stack[STACKSIZE];
+        vector<SearchItem> spill;
+        int top = 0;
+        const Node* node = root;
+        int depth = 0;
+        while (true) {
+            // go down to the leaf on the side of key, remember the other side
+            while (node && visits < budget) {
+                visits++;
+                const PointT& p = point(node);
+                T dis = key.squareDistance(p);
+                if (dis < best.squareDistance) {
+                    best.squareDistance = dis;
+                    best.point = &p;
+                }
+                int d = depth%k;
+                T diff = key[d] - p[d];
+                const Node* farNode = (diff < 0) ? node->right : node->left;
+                if (farNode && diff*diff < best.squareDistance*scale) {
+                    SearchItem item = {farNode, depth + 1, diff*diff};
+                    if (top < STACKSIZE) stack[top++] = item;
+                    else spill.push_back(item);
+                }
+                node = (diff < 0) ? node->left : node->right;
+                depth++;
             }
-        }
-        else {
-            if (node->right) {
-                // find the nearest point in the right subtree
-                Point3D nearPointRight = nearestPointRec(node->right, key, depth + 1);
-                // compare which is smaller, the root point and the right subtree point
-                if (key.squareDistance(nearPointRight) < key.squareDistance(nearPoint))
-                    nearPoint = nearPointRight;
+            if (visits >= budget) break;
+            // take the next far side which may still contain a nearer point
+            SearchItem item;
+            if (!spill.empty()) {
+                item = spill.back();
+                spill.pop_back();
             }
-            // if the distance between key and the divided plane is smaller, find the nearest point in the left subtree
-            if (node->left && (key[d] - (*node->data)[d])*(key[d] - (*node->data)[d]) < key.squareDistance(nearPoint)) {
-                Point3D nearPointLeft = nearestPointRec(node->left, key, depth + 1);
-                if (key.squareDistance(nearPointLeft) < key.squareDistance(nearPoint))
-                    nearPoint = nearPointLeft;
+            else if (top > 0) item = stack[--top];
+            else break;
+            if (item.planeDis < best.squareDistance*scale) {
+                node = item.node;
+                depth = item.depth;
             }
         }
-        return nearPoint;
+        STATS_ADD(QUERIES, 1);
+        STATS_ADD(NODES_VISITED, visits);
+        STATS_ADD(DISTANCE_EVALS, visits);
+        return best;
+    }
+
+    PointT nearestPoint(const PointT& key, T epsilon = 0, size_t maxVisits = 0) const
+    {
+        NearestResult<PointT> res = nearest(key, epsilon, maxVisits);
+        if (!res.point) throw "empty tree";
+        return *res.point;
+    }
+
+    /////////// answer a batch of queries, out must have room for n points, run on pool if it is given
+    void nearestPointBatch(const PointT* keys, size_t n, PointT* out, ThreadPool* pool = nullptr) const
+    {
+        if (n > 0 && !root) throw "empty tree";
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = *nearest(keys[i]).point;
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    void closePointBatch(const PointT* keys, size_t n, T maxDis, vector<PointT>* out, ThreadPool* pool = nullptr) const
+    {
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = closePoint(keys[i], maxDis);
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    /////////// find k nearest Points
+    ////// scale is 1/(1 + epsilon)^2, budget is the number of nodes which can still be visited
+    void kNearestRec(KNearestHeap<PointT>& heap, Node* node, const PointT& key, int depth, T scale, size_t& budget) const
+    {
+        if (!node || budget == 0) return;
+        budget--;
+        int d = depth%k;
+        heap.push(key.squareDistance(point(node)), &point(node));
+        T diff = key[d] - point(node)[d];
+        Node* nearNode = (diff < 0) ? node->left : node->right;
+        Node* farNode = (diff < 0) ? node->right : node->left;
+        kNearestRec(heap, nearNode, key, depth + 1, scale, budget);
+        // the other side can only contain a better point if the divided plane is closer than the k-th point,
+        // (1 + epsilon) times closer for an approximate answer
+        if (diff*diff < heap.worst()*scale)
+            kNearestRec(heap, farNode, key, depth + 1, scale, budget);
+    }
+
+    ////// epsilon and maxVisits are the same as in nearest, the i-th point is at most (1 + epsilon) times
+    ////// farther than the true i-th nearest point
+    vector<PointT> kNearest(const PointT& key, size_t kn, T epsilon = 0, size_t maxVisits = 0) const
+    {
+        KNearestHeap<PointT> heap(kn);
+        size_t start = maxVisits ? maxVisits : numeric_limits<size_t>::max(), budget = start;
+        kNearestRec(heap, root, key, 0, 1/((1 + epsilon)*(1 + epsilon)), budget);
+        STATS_ADD(QUERIES, 1);
+        STATS_ADD(NODES_VISITED, start - budget);
+        STATS_ADD(DISTANCE_EVALS, start - budget);
+        return heap.sorted();
+    }
+
+    /////////// number of nodes at every depth, the root is at depth 0
+    vector<size_t> depthHistogram() const
+    {
+        vector<size_t> hist;
+        vector<pair<const Node*, int>> stack;
+        if (root) stack.push_back(make_pair(root, 0));
+        while (!stack.empty()) {
+            const Node* node = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (hist.size() <= size_t(depth)) hist.resize(depth + 1, 0);
+            hist[depth]++;
+            if (node->left) stack.push_back(make_pair(node->left, depth + 1));
+            if (node->right) stack.push_back(make_pair(node->right, depth + 1));
+        }
+        return hist;
     }
 
-    Point3D nearestPoint(const Point3D& key)
+    /////////// summary of the tree instead of printing every node
+    void printStats(ostream& out = cout) const
     {
-        return nearestPointRec(root, key, 0);
+        vector<size_t> hist = depthHistogram();
+        out << "KD TREE: " << getSize() << " nodes, height " << hist.size() << ", " << rebuilt << " nodes rebuilt\n";
+        out << "nodes per depth:\n";
+        for (size_t i=0; i<hist.size(); i++) out << "  " << i << ": " << hist[i] << "\n";
     }
 
     /////////// print tree
-    void printTree()
+    void printTree() const
     {
         cout << "/////////////////KD TREE//////////////////\n";
         printRec(root, 0);
@@ -2,6 +2,11 @@
 #define LSHASH_H
 
 #include "point&plane.h"
+#include "ThreadPool.h"
+#include "PointStore.h"
+#include "Snapshot.h"
+#include "QueryStats.h"
+#include "SpaceFillingCurve.h"
 #include <iostream>
 #include <vector>
 #include <cmath>
@@ -11,235 +16,884 @@
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <cstring>
+#include <cstdint>
+#include <queue>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+////// parameters of LSH, the same parameters and points always give the same tables
+struct LSHParams
+{
+    int L = 20; // the number of hash table
+    int k = -1; // the number of cut planes of every table, -1 for log2(N)
+    unsigned seed = 5489; // seed of the random planes
+    double maxLoad = 2; // the tables grow when there are more than maxLoad points per bucket, 0 for never
+    CurveKind curve = CURVE_NONE; // order of the points of a bulk insert or a batch in the store
+};
+
+////// locality sensitive hash of points with D coordinates of type T
+template<int D = 3, class T = float>
 class LSH
 {
-    static const int D = 3, L = 20; // D is the number of dimensions, L is the number of hash table
-    int k, bot, top; // n is the number of points, k is the number of cut planes
-    size_t capacity, n = 0;
-    vector<vector<CutPlane>> ktab;
-    vector<vector<vector<const Point3D*>>> hashtab;
+    typedef Point<D, T> PointT;
+    static const int MAXL = 64, MAXK = 56; // k < 57 so the k+1 bits of a table can be read from one 64-bit word
+    int L; // L is the number of hash table
+    int k; // every bucket has k planes, a split bucket also uses plane k, so a table has k+1 planes
+    int bot, top; // the planes go through points of [bot, top]^D
+    size_t capacity, n = 0; // capacity is the number of buckets of every table, 2^k + split
+    // linear hashing: buckets [0, split) have been split by plane k into themselves and bucket + 2^k,
+    // when every bucket is split k grows by one and split goes back to 0
+    size_t split = 0;
+    unsigned seed;
+    double maxLoad;
+    CurveKind curve;
+    vector<vector<CutPlane<D, T>>> ktab; // the k+1 planes of every table
+    // coefficients of all L*(k+1) planes as floats in structure of arrays, plane j of table i is at i*(k+1) + j,
+    // padded with zero planes to a multiple of 8 for the vector hashing
+    vector<T> coef[D+1];
+    vector<T> invNorm; // 1/|normal|^2 of every plane, the square distance to a plane is value^2*invNorm
+    size_t probes = 64; // default number of extra buckets checked by multi-probe queries
+    PointStore<PointT> store; // the table owns its points, buckets only keep their ids
+    vector<vector<vector<uint32_t>>> hashtab;
+    vector<uint32_t> slot; // back references: point id is at hashtab[i][bucket][slot[id*L + i]], not kept when frozen
+    // frozen mode: every table is packed into bucket offsets and point ids (compressed sparse rows),
+    // every point is in all tables so table i has n ids, they are ids[i*n .. (i+1)*n),
+    // bucket j of table i is ids[i*n + offsets[i*(capacity+1) + j] .. i*n + offsets[i*(capacity+1) + j+1])
+    bool frozen = 0;
+    vector<uint32_t> packedOffset, packedIds;
+    const uint32_t* offsets = nullptr; // packedOffset and packedIds, or the arrays of a mapped snapshot
+    const uint32_t* ids = nullptr;
+    shared_ptr<const Snapshot> snapshot;
 public:
-    LSH(size_t N, int bot = 0, int top = 100) : bot(bot), top(top)
+    LSH(size_t N, int bot = 0, int top = 100, const LSHParams& params = LSHParams())
+        : L(params.L), bot(bot), top(top), seed(params.seed), maxLoad(params.maxLoad), curve(params.curve)
     {
-        this->k = log2(N); // k = log2(N) for the best performance
-        this->capacity = pow(2, k);
-        // random create k planes for L hash tables
-        mt19937 rng(static_cast<int>(time(nullptr)));
-        uniform_int_distribution<int> dis(-top, top);
+        this->k = (params.k >= 0) ? params.k : int(log2(max<size_t>(N, 1))); // k = log2(N) for the best performance
+        if (L < 1 || L > MAXL) throw "L is out of range";
+        if (k > MAXK) throw "k is out of range";
+        this->capacity = size_t(1) << k;
         ktab.resize(L);
         hashtab.resize(L);
+        for (int i=0; i<L; i++) hashtab[i].resize(this->capacity);
+        for (int j=0; j<=k; j++) addLevel(j);
+        layoutPlanes();
+    }
+
+    ////// add plane number level to every table: the normal is a gaussian vector, so every direction is equally likely,
+    ////// and the plane goes through a uniform random point of [bot, top]^D, so it always cuts the space.
+    ////// Every level has its own random stream, so a table grown to k planes has the planes of a table made with k
+    void addLevel(int level)
+    {
+        seed_seq sequence{seed, unsigned(level)};
+        mt19937 rng(sequence);
+        normal_distribution<double> normal(0, 1);
+        uniform_real_distribution<double> inside(bot, top);
         for (int i=0; i<L; i++) {
-            hashtab[i].resize(this->capacity);
-            for (int j=0; j<k; j++) {
-                vector<int> plane(D+1);
-                // make sure created planes is not out of space
-                while (true) {
-                    for (int& x : plane) x = dis(rng);
-                    int range[2] = {bot, top};
-                    int numcor = 1 << D;
-                    vector<int> exp(numcor, plane[D]);
-                    for (int t=0; t<numcor; t++) {
-                        for (int u=0; u<D; u++) {
-                            exp[t] += plane[u]*range[(t%(numcor >> u))/(numcor >> (u+1))];
-                        }
-                        exp[t] *= plane[0];
-                    }
-                    bool b1 = 0, b2 = 0;
-                    for (int t=0; t<numcor/2; t++) {
-                        if (exp[t]>=0) {
-                            b1 = 1;
-                            break;
-                        }
-                    }
-                    for (int t=numcor/2; t<numcor && b1; t++) {
-                        if (exp[t]<=0) {
-                            b2 = 1;
-                            break;
-                        }
-                    }
-                    if (b1 && b2) break;
+            vector<T> plane(D+1);
+            T offset = 0;
+            for (int u=0; u<D; u++) {
+                plane[u] = normal(rng);
+                offset -= plane[u]*T(inside(rng));
+            }
+            plane[D] = offset;
+            ktab[i].push_back(CutPlane<D, T>(plane));
+        }
+    }
+
+    ////// copy the planes of ktab into coef and invNorm
+    void layoutPlanes()
+    {
+        int stride = k + 1;
+        size_t numPlanes = (L*stride + 7)/8*8;
+        for (int u=0; u<=D; u++) {
+            coef[u].assign(numPlanes, 0);
+            for (int i=0; i<L; i++)
+                for (int j=0; j<stride; j++) coef[u][i*stride + j] = ktab[i][j].getCoef(u);
+        }
+        invNorm.assign(numPlanes, 0);
+        for (int j=0; j<L*stride; j++) {
+            T norm = 0;
+            for (int u=0; u<D; u++) norm += coef[u][j]*coef[u][j];
+            invNorm[j] = 1/norm;
+        }
+    }
+
+    int getL() const {return L;}
+    ////// plane j of table itab, j <= k, plane k splits the buckets [0, split)
+    const CutPlane<D, T>& getPlane(int itab, int j) const {return ktab[itab][j];}
+    int getK() const {return k;}
+    size_t getSize() const {return n;}
+    size_t numBuckets() const {return capacity;}
+
+    ////// call visit(point) for every point of the table, in the order of their ids
+    template<class F>
+    void forEachPoint(F visit) const
+    {
+        for (uint32_t id=0; id<store.size(); id++)
+            if (store.alive(id)) visit(store[id]);
+    }
+
+    ////// number of extra buckets checked by nearestPoint, closePoint and kNearest when no budget is given
+    void setProbes(size_t probes) {this->probes = probes;}
+    size_t getProbes() const {return probes;}
+
+    //////////////// bucket of a hash of k+1 bits, only the split buckets use bit k
+    size_t bucketOf(size_t hash) const
+    {
+        size_t index = hash & ((size_t(1) << k) - 1);
+        return (index < split) ? (hash & ((size_t(2) << k) - 1)) : index;
+    }
+
+    //////////////// number of planes of all tables with the padding
+    size_t numPlanes() const {return coef[0].size();}
+
+    //////////////// buffer for the plane values of one query, one per thread
+    static T* valueBuffer(size_t size)
+    {
+        static thread_local vector<T> values;
+        if (values.size() < size) values.resize(size);
+        return values.data();
+    }
+
+    //////////////// values of the planes [from, to) at key, from and to are multiples of 8. Bit j - from of signs is set if
+    //////////////// plane j is not negative, values gets the value of plane j at j - from if it is given.
+    //////////////// This is the only place where planes are evaluated, so insert, split, remove and query always agree
+    //////////////// on a sign. A product and a sum are fused only by an explicit FMA, never by the compiler
+    void planeSigns(const PointT& key, size_t from, size_t to, unsigned char* signs, T* values) const
+    {
+#if defined(__AVX2__) || defined(__SSE2__)
+        if constexpr (is_same<T, float>::value) {
+            const T* w = coef[D].data();
+#if defined(__AVX2__)
+            __m256 zero = _mm256_setzero_ps();
+            for (size_t j=from; j<to; j+=8) {
+                __m256 value = _mm256_loadu_ps(w + j);
+                for (int u=0; u<D; u++) {
+#if defined(__FMA__)
+                    value = _mm256_fmadd_ps(_mm256_set1_ps(key[u]), _mm256_loadu_ps(coef[u].data() + j), value);
+#else
+                    value = _mm256_add_ps(value, _mm256_mul_ps(_mm256_set1_ps(key[u]), _mm256_loadu_ps(coef[u].data() + j)));
+#endif
+                }
+                if (values) _mm256_storeu_ps(values + (j - from), value);
+                signs[(j - from)/8] = _mm256_movemask_ps(_mm256_cmp_ps(value, zero, _CMP_GE_OQ));
+            }
+#else
+            __m128 zero = _mm_setzero_ps();
+            for (size_t j=from; j<to; j+=4) {
+                __m128 value = _mm_loadu_ps(w + j);
+                for (int u=0; u<D; u++) {
+#if defined(__FMA__)
+                    value = _mm_fmadd_ps(_mm_set1_ps(key[u]), _mm_loadu_ps(coef[u].data() + j), value);
+#else
+                    value = _mm_add_ps(value, _mm_mul_ps(_mm_set1_ps(key[u]), _mm_loadu_ps(coef[u].data() + j)));
+#endif
+                }
+                if (values) _mm_storeu_ps(values + (j - from), value);
+                signs[(j - from)/8] |= _mm_movemask_ps(_mm_cmpge_ps(value, zero)) << (j%8);
+            }
+#endif
+        }
+        else
+#endif
+        {
+            for (size_t j=from; j<to; j++) {
+                T value = coef[D][j];
+                for (int u=0; u<D; u++) {
+#if defined(__FMA__)
+                    value = fma(key[u], coef[u][j], value);
+#else
+                    value += key[u]*coef[u][j];
+#endif
                 }
-                ktab[i].push_back(CutPlane(plane));
+                if (values) values[j - from] = value;
+                if (value >= 0) signs[(j - from)/8] |= 1 << (j%8);
             }
         }
     }
 
-    //////////////// hash function
-    size_t hashing(const Point3D& key, int itab)
+    //////////////// hash key into all L tables at once, the sign of every plane becomes one bit,
+    //////////////// values gets the value of every plane if it is given, it must have room for numPlanes() values
+    void hashAll(const PointT& key, size_t* indices, T* values = nullptr) const
     {
-        size_t index = 0;
-        for (size_t i=0; i<size_t(k); i++) {
-            size_t bitmask = 1 << i;
-            if (ktab[itab][i].getValue(key) < 0) continue;
-            else index = index | bitmask;
+        unsigned char signs[MAXL*(MAXK + 1)/8 + 16] = {}; // bit j is the sign of plane j
+        planeSigns(key, 0, coef[0].size(), signs, values);
+        // the k+1 bits of table i start at bit i*(k+1)
+        uint64_t mask = (uint64_t(2) << k) - 1;
+        for (int i=0; i<L; i++) {
+            size_t bit = size_t(i)*(k + 1);
+            uint64_t word;
+            memcpy(&word, signs + bit/8, sizeof(word));
+            indices[i] = bucketOf((word >> (bit%8)) & mask);
         }
-        return index;
     }
 
-    //////////////// insert point
-    void insert(const Point3D& key)
+    //////////////// call visit(id) for every point in bucket index of table itab
+    template<class F>
+    void scanBucket(int itab, size_t index, F visit) const
     {
-        for (int i=0; i<L; i++){
-            hashtab[i][hashing(key, i)].push_back(&key);
+        if (frozen) {
+            const uint32_t* table = ids + size_t(itab)*n;
+            const uint32_t* offset = offsets + size_t(itab)*(capacity + 1) + index;
+            for (uint32_t j = offset[0]; j < offset[1]; j++) visit(table[j]);
         }
-        n++;
+        else {
+            for (uint32_t id : hashtab[itab][index]) visit(id);
+        }
+    }
+
+    size_t bucketSize(int itab, size_t index) const
+    {
+        if (frozen) {
+            const uint32_t* offset = offsets + size_t(itab)*(capacity + 1) + index;
+            return offset[1] - offset[0];
+        }
+        else return hashtab[itab][index].size();
     }
 
-    /////////////// remove point
-    bool remove(const Point3D& key)
+    //////////////// pack all tables into contiguous arrays, the table is read only until thaw
+    void freeze()
     {
-        bool suc = 0;
+        if (frozen) return;
+        packedOffset.assign(L*(capacity + 1), 0);
+        packedIds.clear();
+        packedIds.reserve(L*n);
         for (int i=0; i<L; i++) {
-            size_t hashIndex = hashing(key, i);
-            for (auto j=hashtab[i][hashIndex].begin(); j!=hashtab[i][hashIndex].end(); j++) {
-                if (*(*j)==key) {
-                    hashtab[i][hashIndex].erase(j);
-                    suc = 1;
-                    break;
-                }
+            uint32_t* offset = packedOffset.data() + i*(capacity + 1);
+            for (size_t j=0; j<capacity; j++) {
+                packedIds.insert(packedIds.end(), hashtab[i][j].begin(), hashtab[i][j].end());
+                offset[j + 1] = packedIds.size() - i*n;
             }
         }
-        if (suc) n--;
-        return suc;
+        vector<vector<vector<uint32_t>>>().swap(hashtab);
+        vector<uint32_t>().swap(slot);
+        offsets = packedOffset.data();
+        ids = packedIds.data();
+        frozen = 1;
     }
 
-    /////////////// find the nearest point
-    Point3D nearestPoint(const Point3D& key)
+    //////////////// unpack the tables so that points can be inserted and removed again
+    void thaw()
     {
+        if (!frozen) return;
+        hashtab.assign(L, vector<vector<uint32_t>>(capacity));
+        slot.assign(size_t(store.size())*L, 0);
+        for (int i=0; i<L; i++) {
+            for (size_t j=0; j<capacity; j++) {
+                scanBucket(i, j, [&](uint32_t id) {
+                    slot[size_t(id)*L + i] = hashtab[i][j].size();
+                    hashtab[i][j].push_back(id);
+                });
+            }
+        }
+        vector<uint32_t>().swap(packedOffset);
+        vector<uint32_t>().swap(packedIds);
+        offsets = ids = nullptr;
+        frozen = 0;
+    }
 
-        if (n==0) throw "empty table"; // if hash tables are empty, throw exception
-        Point3D minp;
-        float mind = FLT_MAX;
-        // guessing the nearest point by hash method
+    bool isFrozen() const {return frozen;}
+
+    //////////////// write the planes, the points and the packed tables to a snapshot, frozen or not.
+    //////////////// Ids are renumbered so that the points of the snapshot have no hole
+    void save(const string& path) const
+    {
+        SnapshotWriter out(path, SNAPSHOT_LSH, D, sizeof(T));
+        size_t planes = numPlanes();
+        uint64_t meta[11] = {uint64_t(L), uint64_t(k), uint64_t(int64_t(bot)), uint64_t(int64_t(top)), n, capacity, probes,
+                             planes, seed, split, 0};
+        memcpy(&meta[10], &maxLoad, sizeof(double));
+        out.section(meta, sizeof(meta));
+        out.beginSection();
+        for (int u=0; u<=D; u++) out.write(coef[u].data(), planes*sizeof(T));
+        out.section(invNorm.data(), planes*sizeof(T));
+        vector<uint32_t> remap(store.size(), PointStore<PointT>::NONE);
+        uint32_t next = 0;
+        out.beginSection();
+        for (uint32_t id=0; id<store.size(); id++) {
+            if (!store.alive(id)) continue;
+            remap[id] = next++;
+            out.write(&store[id], sizeof(PointT));
+        }
+        vector<uint32_t> buffer(capacity + 1);
+        out.beginSection();
         for (int i=0; i<L; i++) {
-            size_t hashIndex = hashing(key, i);
-            for (const Point3D* x : hashtab[i][hashIndex]) {
-                float newdis = key.squareDistance(*x);
-                if (newdis < mind) {
-                    mind = newdis;
-                    minp = *x;
-                }
+            buffer[0] = 0;
+            for (size_t j=0; j<capacity; j++) buffer[j + 1] = buffer[j] + bucketSize(i, j);
+            out.write(buffer.data(), buffer.size()*sizeof(uint32_t));
+        }
+        out.beginSection();
+        for (int i=0; i<L; i++) {
+            buffer.clear();
+            for (size_t j=0; j<capacity; j++) scanBucket(i, j, [&](uint32_t id) {buffer.push_back(remap[id]);});
+            out.write(buffer.data(), buffer.size()*sizeof(uint32_t));
+        }
+        out.finish();
+    }
+
+    //////////////// load a snapshot as a frozen table, the points and the tables are used in place.
+    //////////////// After thaw, inserted points are copied as usual and removed points of the snapshot are not reused
+    void load(const string& path)
+    {
+        shared_ptr<const Snapshot> s = Snapshot::open(path, SNAPSHOT_LSH, D, sizeof(T));
+        const uint64_t* meta = s->array<uint64_t>(0, 11);
+        if (meta[0] < 1 || meta[0] > uint64_t(MAXL) || meta[1] > uint64_t(MAXK) || meta[9] >= (uint64_t(1) << meta[1])
+            || meta[5] != (uint64_t(1) << meta[1]) + meta[9] || meta[7] != (meta[0]*(meta[1] + 1) + 7)/8*8
+            || meta[4] >= PointStore<PointT>::NONE) throw "bad snapshot";
+        int newL = meta[0], newK = meta[1];
+        size_t newN = meta[4], newCapacity = meta[5], planes = meta[7];
+        // the sizes of the tables are checked against the sections before they are multiplied, so they can not overflow
+        if (newCapacity + 1 > s->count<uint32_t>(4)/newL || newN > s->count<uint32_t>(5)/newL) throw "bad snapshot";
+        const T* newCoef = s->array<T>(1, (D + 1)*planes);
+        const T* newInvNorm = s->array<T>(2, planes);
+        const PointT* points = s->array<PointT>(3, newN);
+        const uint32_t* newOffsets = s->array<uint32_t>(4, newL*(newCapacity + 1));
+        const uint32_t* newIds = s->array<uint32_t>(5, newL*newN);
+        // the mapped tables are used without bounds checks, a corrupt file must not make a bucket reach out of them
+        for (int i=0; i<newL; i++) {
+            const uint32_t* off = newOffsets + i*(newCapacity + 1);
+            if (off[0] != 0 || off[newCapacity] != newN) throw "bad snapshot";
+            for (size_t j=0; j<newCapacity; j++)
+                if (off[j + 1] < off[j]) throw "bad snapshot";
+        }
+        for (size_t j=0; j<newL*newN; j++)
+            if (newIds[j] >= newN) throw "bad snapshot";
+
+        L = newL;
+        k = newK;
+        bot = int64_t(meta[2]);
+        top = int64_t(meta[3]);
+        n = newN;
+        capacity = newCapacity;
+        probes = meta[6];
+        seed = meta[8];
+        split = meta[9];
+        memcpy(&maxLoad, &meta[10], sizeof(double));
+        for (int u=0; u<=D; u++) coef[u].assign(newCoef + u*planes, newCoef + (u + 1)*planes);
+        invNorm.assign(newInvNorm, newInvNorm + planes);
+        ktab.assign(L, vector<CutPlane<D, T>>());
+        for (int i=0; i<L; i++) {
+            for (int j=0; j<=k; j++) {
+                vector<T> plane(D+1);
+                for (int u=0; u<=D; u++) plane[u] = coef[u][i*(k + 1) + j];
+                ktab[i].push_back(CutPlane<D, T>(plane));
             }
         }
-        // backup check
-        vector<int> flexIndex;
-        int tabIndex = 0;
-        // find the most effective hash table to check
-        for (int i=0, minflex = this->k + 1; i<L; i++) {
-            vector<int> flexIndexTemp;
-            for (int j=0; j<this->k; j++) {
-                if (ktab[0][j].squareDistance(key) < mind)
-                    flexIndexTemp.push_back(j);
-            }
-            if (flexIndexTemp.size() < size_t(minflex)) {
-                minflex = flexIndexTemp.size();
-                flexIndex = flexIndexTemp;
-                tabIndex = i;
-            }
-        }
-        // backup check at the most effective hash table
-        size_t numOfCase = pow(2, flexIndex.size()), hashIndex = hashing(key, tabIndex);
-        for (size_t i=0; i<numOfCase; i++) {
-            // change the hash index
-            for (size_t j=0; j<flexIndex.size(); j++) {
-                hashIndex = hashIndex & (~(1 << flexIndex[j]));
-                if (i & (1 << j)) {
-                    hashIndex = hashIndex | (1 << flexIndex[j]);
-                }
+        vector<vector<vector<uint32_t>>>().swap(hashtab);
+        vector<uint32_t>().swap(slot);
+        vector<uint32_t>().swap(packedOffset);
+        vector<uint32_t>().swap(packedIds);
+        store.clear();
+        store.map(points, n);
+        offsets = newOffsets;
+        ids = newIds;
+        frozen = 1;
+        snapshot = s;
+    }
+
+    //////////////// bytes used by the hash tables and the points, not counting the planes and a mapped snapshot
+    size_t memoryUsage() const
+    {
+        size_t bytes = store.memoryUsage();
+        if (frozen) bytes += packedOffset.capacity()*sizeof(uint32_t) + packedIds.capacity()*sizeof(uint32_t);
+        else {
+            bytes += slot.capacity()*sizeof(uint32_t);
+            for (const auto& table : hashtab) {
+                bytes += table.capacity()*sizeof(vector<uint32_t>);
+                for (const auto& bucket : table) bytes += bucket.capacity()*sizeof(uint32_t);
             }
-            // check in new block
-            for (const Point3D* x : hashtab[tabIndex][hashIndex]) {
-                float newDis = key.squareDistance(*x);
-                if (newDis < mind) {
-                    minp = *x;
-                    mind = newDis;
+        }
+        return bytes;
+    }
+
+    //////////////// insert a point of the store into all tables
+    void insertId(uint32_t id)
+    {
+        size_t indices[MAXL];
+        hashAll(store[id], indices);
+        if (slot.size() < (size_t(id) + 1)*L) slot.resize(size_t(store.size())*L);
+        for (int i=0; i<L; i++){
+            slot[size_t(id)*L + i] = hashtab[i][indices[i]].size();
+            hashtab[i][indices[i]].push_back(id);
+        }
+        n++;
+        grow();
+    }
+
+    //////////////// linear hashing: split one bucket after another while there are more than maxLoad points per bucket,
+    //////////////// so growing is spread over the inserts and no insert rehashes the whole table
+    void grow()
+    {
+        while (maxLoad > 0 && n > maxLoad*capacity && k < MAXK) splitBucket();
+    }
+
+    //////////////// move the points of bucket split of every table which are on the positive side of plane k
+    //////////////// to the new bucket split + 2^k
+    void splitBucket()
+    {
+        for (int i=0; i<L; i++) {
+            hashtab[i].emplace_back();
+            vector<uint32_t>& low = hashtab[i][split];
+            vector<uint32_t>& high = hashtab[i].back();
+            size_t j = size_t(i)*(k + 1) + k, block = j/8*8, keep = 0;
+            for (uint32_t id : low) {
+                // bit k of the hash of the point in table i, from the kernel of hashAll which finds the point later
+                unsigned char sign = 0;
+                planeSigns(store[id], block, block + 8, &sign, nullptr);
+                if (sign & (1 << (j - block))) {
+                    slot[size_t(id)*L + i] = high.size();
+                    high.push_back(id);
+                }
+                else {
+                    slot[size_t(id)*L + i] = keep;
+                    low[keep++] = id;
                 }
             }
+            low.resize(keep);
+        }
+        split++;
+        capacity++;
+        if (split == (size_t(1) << k)) {
+            // every bucket uses k+1 bits now, the next level splits them again by a new plane
+            k++;
+            split = 0;
+            addLevel(k);
+            layoutPlanes();
         }
-        return minp;
     }
 
-    ///////////////// find points in the distance
-    vector<Point3D> closePoint(const Point3D& key, float maxDis = 0.0)
+    //////////////// insert point, the point is copied into the table
+    void insert(const PointT& key)
     {
-        vector<Point3D> clp;
-        // guessing points in the distance by hash method
+        if (frozen) throw "frozen table";
+        insertId(store.add(key));
+    }
+
+    //////////////// insert a batch of points, e.g. from PointLoader: they are hashed on pool if it is given, then put into
+    //////////////// the store and the buckets in the order of the curve. The tables grow after the whole batch
+    void insertBatch(const vector<PointT>& points, ThreadPool* pool = nullptr)
+    {
+        if (frozen) throw "frozen table";
+        size_t m = points.size();
+        vector<size_t> indices(m*L);
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t p=lo; p<hi; p++) hashAll(points[p], &indices[p*L]);
+        };
+        if (pool) pool->parallelFor(m, body);
+        else body(0, m);
+        for (uint32_t p : curveOrder(points, curve)) {
+            uint32_t id = store.add(points[p]);
+            if (slot.size() < (size_t(id) + 1)*L) slot.resize(size_t(store.size())*L);
+            for (int i=0; i<L; i++) {
+                vector<uint32_t>& bucket = hashtab[i][indices[size_t(p)*L + i]];
+                slot[size_t(id)*L + i] = bucket.size();
+                bucket.push_back(id);
+            }
+        }
+        n += m;
+        grow();
+    }
+
+    //////////////// insert all points of an empty table, they are moved into the table without copying
+    void insert(vector<PointT>&& points)
+    {
+        if (frozen) throw "frozen table";
+        if (n > 0) {
+            for (const PointT& p : points) insert(p);
+            return;
+        }
+        store.clear();
+        sortByCurve(points, curve);
+        store.assign(move(points));
+        for (uint32_t id=0; id<store.size(); id++) insertId(id);
+    }
+
+    /////////////// id of a point equal to key for which skip(id) is 0, NONE if there is none.
+    /////////////// Equal points are in the same bucket of every table, so only the smallest of these buckets is scanned
+    template<class F>
+    uint32_t findId(const PointT& key, const size_t* indices, F skip) const
+    {
+        int best = 0;
+        for (int i=1; i<L; i++)
+            if (hashtab[i][indices[i]].size() < hashtab[best][indices[best]].size()) best = i;
+        for (uint32_t x : hashtab[best][indices[best]])
+            if (store[x] == key && !skip(x)) return x;
+        return PointStore<PointT>::NONE;
+    }
+
+    /////////////// remove point id from all tables, indices are its buckets: the back reference gives its place
+    /////////////// in every bucket and the last id of the bucket is moved there, so exactly L slots are touched
+    void removeId(uint32_t id, const size_t* indices)
+    {
+        for (int i=0; i<L; i++) {
+            vector<uint32_t>& bucket = hashtab[i][indices[i]];
+            uint32_t pos = slot[size_t(id)*L + i], last = bucket.back();
+            bucket[pos] = last;
+            slot[size_t(last)*L + i] = pos;
+            bucket.pop_back();
+        }
+        store.release(id);
+        n--;
+    }
+
+    /////////////// remove one point equal to key
+    bool remove(const PointT& key)
+    {
+        if (frozen) throw "frozen table";
+        size_t indices[MAXL] = {};
+        hashAll(key, indices);
+        uint32_t id = findId(key, indices, [](uint32_t) {return 0;});
+        if (id == PointStore<PointT>::NONE) return 0;
+        removeId(id, indices);
+        return 1;
+    }
+
+    /////////////// remove one point for every key, a key given twice removes two equal points. Return the number removed.
+    /////////////// A large batch marks its points first and then compacts every bucket once
+    size_t removeBatch(const vector<PointT>& keys)
+    {
+        if (frozen) throw "frozen table";
+        size_t removed = 0;
+        if (keys.size()*4 < n) {
+            for (const PointT& key : keys) removed += remove(key);
+            return removed;
+        }
+        vector<bool> dead(store.size(), 0);
+        size_t indices[MAXL];
+        for (const PointT& key : keys) {
+            hashAll(key, indices);
+            uint32_t id = findId(key, indices, [&](uint32_t x) {return bool(dead[x]);});
+            if (id == PointStore<PointT>::NONE) continue;
+            dead[id] = 1;
+            removed++;
+        }
         for (int i=0; i<L; i++) {
-            size_t hashIndex = hashing(key, i);
-            for (const Point3D* x : hashtab[i][hashIndex]) {
-                bool flag = 1;
-                // check if point has been already found
-                for (const Point3D& y : clp) {
-                    if (y==*x) {
-                        flag = 0;
-                        break;
-                    }
+            for (vector<uint32_t>& bucket : hashtab[i]) {
+                size_t keep = 0;
+                for (uint32_t id : bucket) {
+                    if (dead[id]) continue;
+                    slot[size_t(id)*L + i] = keep;
+                    bucket[keep++] = id;
                 }
-                // if not exist, insert point into return vector
-                if (flag && key.squareDistance(*x) <= maxDis*maxDis) {
-                    clp.push_back(*x);
+                bucket.resize(keep);
+            }
+        }
+        for (uint32_t id=0; id<dead.size(); id++)
+            if (dead[id]) store.release(id);
+        n -= removed;
+        return removed;
+    }
+
+    /////////////// multi-probe: call visit(itab, index) for at most budget buckets next to the buckets of key,
+    /////////////// a bucket is reached by flipping a set of planes of one table, sets are tried in the order of
+    /////////////// the sum of square distances from key to their planes, over all tables.
+    /////////////// A set with a plane not closer than bound() cannot hold a point closer than bound(), so it is skipped
+    struct Probe
+    {
+        T score; // sum of the square distances to the flipped planes
+        int itab, last; // last is the largest flipped position in the sorted planes of table itab
+        uint64_t flip; // flipped positions in the sorted planes
+        bool operator>(const Probe& p) const {return score > p.score;}
+    };
+
+    template<class F, class G>
+    void multiProbe(const size_t* indices, const T* values, size_t budget, G bound, F visit) const
+    {
+        // plane k only separates the split buckets
+        int stride = k + 1, bits = k + (split > 0);
+        if (budget == 0 || bits == 0) return;
+        // planes of every table sorted by their square distance to key
+        vector<pair<T, int>> sorted(L*bits);
+        for (int i=0; i<L; i++) {
+            for (int j=0; j<bits; j++) {
+                int p = i*stride + j;
+                sorted[i*bits + j] = make_pair(values[p]*values[p]*invNorm[p], j);
+            }
+            sort(sorted.begin() + i*bits, sorted.begin() + (i + 1)*bits);
+        }
+        priority_queue<Probe, vector<Probe>, greater<Probe>> heap;
+        for (int i=0; i<L; i++) {
+            if (sorted[i*bits].first < bound()) heap.push(Probe{sorted[i*bits].first, i, 0, 1});
+        }
+        size_t lowMask = (size_t(1) << k) - 1;
+        while (budget > 0 && !heap.empty()) {
+            Probe p = heap.top();
+            heap.pop();
+            const pair<T, int>* planes = &sorted[p.itab*bits];
+            // the bound shrinks during the search, every set made from p also has the plane at position last
+            if (planes[p.last].first >= bound()) continue;
+            // the k+1 bits of key, then the flipped ones
+            size_t hash = indices[p.itab];
+            if (values[p.itab*stride + k] >= 0) hash |= size_t(1) << k;
+            bool flipsK = 0;
+            for (int t=0; t<=p.last; t++) {
+                if (p.flip & (uint64_t(1) << t)) {
+                    hash ^= size_t(1) << planes[t].second;
+                    flipsK |= planes[t].second == k;
                 }
             }
+            // a bucket which is not split ignores plane k, the same set without it reaches the same bucket
+            if (!flipsK || (hash & lowMask) < split) {
+                visit(p.itab, bucketOf(hash));
+                budget--;
+            }
+            // next sets: shift the last plane to the next one, or add the next one
+            int next = p.last + 1;
+            if (next < bits && planes[next].first < bound()) {
+                uint64_t nextBit = uint64_t(1) << next;
+                heap.push(Probe{p.score - planes[p.last].first + planes[next].first, p.itab, next,
+                                (p.flip & ~(uint64_t(1) << p.last)) | nextBit});
+                heap.push(Probe{p.score + planes[next].first, p.itab, next, p.flip | nextBit});
+            }
         }
+    }
+
+    /////////////// find the nearest point, probes is the number of extra buckets to check
+    PointT nearestPoint(const PointT& key) const {return nearestPoint(key, probes);}
+
+    PointT nearestPoint(const PointT& key, size_t probes) const
+    {
 
-        // backup check
-        vector<int> flexIndex;
-        int tabIndex = 0;
-        // find the most effective hash table to check
-        for (int i=0, minflex = this->k + 1; i<L; i++) {
-            vector<int> flexIndexTemp;
-            for (int j=0; j<this->k; j++) {
-                if (ktab[0][j].squareDistance(key) < maxDis*maxDis)
-                    flexIndexTemp.push_back(j);
+        if (n==0) throw "empty table"; // if hash tables are empty, throw exception
+        size_t checked = 0;
+        return *nearestSearch(key, probes, checked);
+    }
+
+    /////////////// checked is increased by the number of points whose distance is computed
+    const PointT* nearestSearch(const PointT& key, size_t probes, size_t& checked) const
+    {
+        size_t checkedBefore = checked;
+        const PointT* minp = nullptr;
+        T mind = numeric_limits<T>::max();
+        // a point is in all L tables, only check it once
+        VisitedSet& visited = VisitedSet::local(store.size());
+        auto check = [&](uint32_t id) {
+            if (!visited.insert(id)) {
+                STATS_ADD(CANDIDATES_DEDUPED, 1);
+                return;
             }
-            if (flexIndexTemp.size() < size_t(minflex)) {
-                minflex = flexIndexTemp.size();
-                flexIndex = flexIndexTemp;
-                tabIndex = i;
+            checked++;
+            T newdis = key.squareDistance(store[id]);
+            if (newdis < mind) {
+                mind = newdis;
+                minp = &store[id];
             }
+        };
+        size_t indices[MAXL];
+        T* values = valueBuffer(numPlanes());
+        hashAll(key, indices, values);
+        // guessing the nearest point by hash method
+        for (int i=0; i<L; i++) scanBucket(i, indices[i], check);
+        // check the buckets next to key in all tables
+        size_t extra = 0;
+        multiProbe(indices, values, probes, [&]() {return mind;},
+                   [&](int itab, size_t index) {scanBucket(itab, index, check); extra++;});
+        // nothing in the buckets of key and the probes, the nearest point may be anywhere
+        if (!minp) {
+            STATS_ADD(FULL_SCANS, 1);
+            for (size_t j=0; j<capacity; j++) scanBucket(0, j, check);
         }
-        // backup check at the most effective hash table
-        size_t numOfCase = pow(2, flexIndex.size()), hashIndex = hashing(key, tabIndex);
-        for (size_t i=0; i<numOfCase; i++) {
-            // change the hash index
-            for (size_t j=0; j<flexIndex.size(); j++) {
-                hashIndex = hashIndex & (~(1 << flexIndex[j]));
-                if (i & (1 << j)) {
-                    hashIndex = hashIndex | (1 << flexIndex[j]);
+        STATS_ADD(QUERIES, 1);
+        STATS_ADD(BUCKETS_PROBED, L + extra);
+        STATS_ADD(EXTRA_PROBES, extra);
+        STATS_ADD(DISTANCE_EVALS, checked - checkedBefore);
+        return minp;
+    }
+
+    /////////////// choose L and k for data: the points of a sample are hashed with every pair of L and k, some held-out
+    /////////////// points are queried, and the cheapest pair whose nearest point recall reaches targetRecall is returned.
+    /////////////// The cost of a query is L*k plane evaluations plus the points checked. k is scaled from the sample to data
+    static LSHParams autoTune(const vector<PointT>& data, double targetRecall = 0.9, int bot = 0, int top = 100,
+                              unsigned seed = 5489, size_t sampleSize = 20000, size_t numQueries = 200)
+    {
+        if (data.size() < 2) return LSHParams();
+        mt19937 rng(seed);
+        vector<size_t> order(data.size());
+        for (size_t i=0; i<order.size(); i++) order[i] = i;
+        shuffle(order.begin(), order.end(), rng);
+        numQueries = min(numQueries, data.size()/2);
+        sampleSize = min(sampleSize, data.size() - numQueries);
+        vector<PointT> queries, sample;
+        for (size_t i=0; i<numQueries; i++) queries.push_back(data[order[i]]);
+        for (size_t i=0; i<sampleSize; i++) sample.push_back(data[order[numQueries + i]]);
+        // exact nearest distances by brute force
+        vector<T> exact(numQueries, numeric_limits<T>::max());
+        for (size_t q=0; q<numQueries; q++)
+            for (const PointT& p : sample) exact[q] = min(exact[q], queries[q].squareDistance(p));
+
+        int sampleK = log2(sampleSize);
+        int scale = int(round(log2(double(data.size())/sampleSize))); // extra bits of k for the whole data
+        LSHParams best, bestRecallParams;
+        double bestCost = numeric_limits<double>::max(), bestRecall = -1;
+        for (int L = 1; L <= MAXL; L *= 2) {
+            for (int k = max(1, sampleK - 8); k <= min(MAXK - scale, sampleK + 2); k++) {
+                LSHParams params;
+                params.L = L;
+                params.k = k;
+                params.seed = seed;
+                params.maxLoad = 0; // the sample table keeps k
+                LSH table(sampleSize, bot, top, params);
+                for (const PointT& p : sample) table.insert(p);
+                size_t hit = 0, checked = 0;
+                for (size_t q=0; q<numQueries; q++) {
+                    const PointT* p = table.nearestSearch(queries[q], table.probes, checked);
+                    if (queries[q].squareDistance(*p) <= exact[q]) hit++;
                 }
-            }
-            // check in new block
-            for (const Point3D* x : hashtab[tabIndex][hashIndex]) {
-                bool flag = 1;
-                for (const Point3D& y : clp) {
-                    if (y==*x) {
-                        flag = 0;
-                        break;
-                    }
+                double recall = double(hit)/numQueries;
+                double cost = double(checked)/numQueries + L*k;
+                params.k = k + scale;
+                // the table may grow with data, keeping the number of points per bucket found here
+                params.maxLoad = 2*double(data.size())/ldexp(1.0, params.k);
+                if (recall >= targetRecall && cost < bestCost) {
+                    bestCost = cost;
+                    best = params;
                 }
-                if (flag && key.squareDistance(*x) <= maxDis*maxDis) {
-                    clp.push_back(*x);
+                if (recall > bestRecall) {
+                    bestRecall = recall;
+                    bestRecallParams = params;
                 }
             }
         }
+        // no pair reaches the target, take the most accurate one
+        return (bestCost < numeric_limits<double>::max()) ? best : bestRecallParams;
+    }
+
+    ///////////////// call visit(point) for every point found in the distance, nothing is copied
+    template<class F>
+    void visitRadius(const PointT& key, T maxDis, size_t probes, F visit) const
+    {
+        VisitedSet& visited = VisitedSet::local(store.size());
+        // if point has not been checked and is in the distance, visit it
+        auto check = [&](uint32_t id) {
+            if (!visited.insert(id)) {
+                STATS_ADD(CANDIDATES_DEDUPED, 1);
+                return;
+            }
+            STATS_ADD(DISTANCE_EVALS, 1);
+            if (key.squareDistance(store[id]) <= maxDis*maxDis) visit(store[id]);
+        };
+        size_t indices[MAXL];
+        T* values = valueBuffer(numPlanes());
+        hashAll(key, indices, values);
+        // guessing points in the distance by hash method
+        for (int i=0; i<L; i++) scanBucket(i, indices[i], check);
+        // only buckets behind planes closer than maxDis can hold points in the distance
+        size_t extra = 0;
+        multiProbe(indices, values, probes, [&]() {return maxDis*maxDis;},
+                   [&](int itab, size_t index) {scanBucket(itab, index, check); extra++;});
+        STATS_ADD(QUERIES, 1);
+        STATS_ADD(BUCKETS_PROBED, L + extra);
+        STATS_ADD(EXTRA_PROBES, extra);
+    }
+
+    ///////////////// find points in the distance
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0.0) const {return closePoint(key, maxDis, probes);}
+
+    vector<PointT> closePoint(const PointT& key, T maxDis, size_t probes) const
+    {
+        vector<PointT> clp;
+        visitRadius(key, maxDis, probes, [&](const PointT& p) {clp.push_back(p);});
         return clp;
     }
 
+    ///////////////// count points found in the distance
+    size_t countInRadius(const PointT& key, T maxDis) const {return countInRadius(key, maxDis, probes);}
+
+    size_t countInRadius(const PointT& key, T maxDis, size_t probes) const
+    {
+        size_t count = 0;
+        visitRadius(key, maxDis, probes, [&](const PointT&) {count++;});
+        return count;
+    }
+
+    ///////////////// answer a batch of queries, out must have room for n results, run on pool if it is given
+    void nearestPointBatch(const PointT* keys, size_t n, PointT* out, ThreadPool* pool = nullptr) const
+    {
+        if (n > 0 && this->n == 0) throw "empty table";
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = nearestPoint(keys[i]);
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    void closePointBatch(const PointT* keys, size_t n, T maxDis, vector<PointT>* out, ThreadPool* pool = nullptr) const
+    {
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = closePoint(keys[i], maxDis);
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    ///////////////// find k nearest points
+    vector<PointT> kNearest(const PointT& key, size_t kn) const {return kNearest(key, kn, probes);}
+
+    vector<PointT> kNearest(const PointT& key, size_t kn, size_t probes) const
+    {
+        KNearestHeap<PointT> heap(kn);
+        VisitedSet& visited = VisitedSet::local(store.size());
+        auto check = [&](uint32_t id) {
+            if (!visited.insert(id)) {
+                STATS_ADD(CANDIDATES_DEDUPED, 1);
+                return;
+            }
+            STATS_ADD(DISTANCE_EVALS, 1);
+            heap.push(key.squareDistance(store[id]), &store[id]);
+        };
+        size_t indices[MAXL];
+        T* values = valueBuffer(numPlanes());
+        hashAll(key, indices, values);
+        // guessing k nearest points by hash method
+        for (int i=0; i<L; i++) scanBucket(i, indices[i], check);
+        // the probes are bounded by the distance of the k-th point found
+        size_t extra = 0;
+        multiProbe(indices, values, probes, [&]() {return heap.worst();},
+                   [&](int itab, size_t index) {scanBucket(itab, index, check); extra++;});
+        STATS_ADD(QUERIES, 1);
+        STATS_ADD(BUCKETS_PROBED, L + extra);
+        STATS_ADD(EXTRA_PROBES, extra);
+        return heap.sorted();
+    }
+
+    //////////// histogram of the sizes of all buckets of all tables, bins are powers of two (see addToLog2Histogram)
+    vector<size_t> bucketHistogram() const
+    {
+        vector<size_t> hist;
+        for (int i=0; i<L; i++)
+            for (size_t j=0; j<capacity; j++) addToLog2Histogram(hist, bucketSize(i, j));
+        return hist;
+    }
+
+    //////////// summary of the tables instead of printing every bucket
+    void printStats(ostream& out = cout) const
+    {
+        out << "LSH: " << n << " points, L = " << L << ", k = " << k << ", " << capacity << " buckets per table";
+        if (split > 0) out << " (" << split << " split by plane " << k << ")";
+        out << (frozen ? ", frozen" : "") << "\n";
+        out << "bucket sizes:\n";
+        printLog2Histogram(out, bucketHistogram());
+    }
+
     //////////// print hash table
-    void print(int i = 0)
+    void print(int i = 0) const
     {
         cout << "******* HASH TABLE " << i << " *******\n";
         for (size_t j=0; j<this->capacity; j++) {
             cout << setw(10) << j << ": ";
-            if (hashtab[i][j].size()==0)
+            if (bucketSize(i, j)==0)
                 cout << setw(25) << "NULL";
             else {
-                cout << setw(25) << *hashtab[i][j][0];
-                for (size_t k=1; k<hashtab[i][j].size(); k++)
-                    cout << "->" << setw(25) << *hashtab[i][j][k];
+                bool first = 1;
+                scanBucket(i, j, [&](uint32_t id) {
+                    if (!first) cout << "->";
+                    cout << setw(25) << store[id];
+                    first = 0;
+                });
             }
             cout << endl;
         }
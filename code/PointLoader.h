@@ -0,0 +1,283 @@
+#ifndef POINTLOADER_H
+#define POINTLOADER_H
+
+#include "point&plane.h"
+#include "ThreadPool.h"
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+using namespace std;
+
+////// queue with a size limit between two stages of a pipeline: push waits while it is full, pop waits while it is empty.
+////// close() ends the stream: pop still returns the items left, push returns 0 so a producer stops when the consumer quits
+template<class X>
+class BoundedQueue
+{
+    deque<X> items;
+    size_t limit;
+    bool closed = 0;
+    mutex mtx;
+    condition_variable notFull, notEmpty;
+public:
+    BoundedQueue(size_t limit) : limit(max<size_t>(limit, 1)) {}
+
+    bool push(X&& x)
+    {
+        unique_lock<mutex> lock(mtx);
+        notFull.wait(lock, [this]() {return closed || items.size() < limit;});
+        if (closed) return 0;
+        items.push_back(move(x));
+        notEmpty.notify_one();
+        return 1;
+    }
+
+    ////// return 0 if the queue is closed and empty
+    bool pop(X& x)
+    {
+        unique_lock<mutex> lock(mtx);
+        notEmpty.wait(lock, [this]() {return closed || !items.empty();});
+        if (items.empty()) return 0;
+        x = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return 1;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(mtx);
+        closed = 1;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+};
+
+////// binary: the D coordinates of type T of every point, one point after another, in the byte order of the machine.
+////// CSV: one point per line, coordinates separated by commas, semicolons or spaces, extra columns are ignored,
+////// a line which does not start with a number (a header, a comment) is skipped
+enum PointFormat {POINTS_BINARY, POINTS_CSV};
+
+////// read a point file as a stream of batches: one thread reads large chunks ahead, one thread parses them (on a pool
+////// if it is given) and the caller consumes the batches in file order, so reading, parsing and inserting overlap.
+////// At most depth chunks wait between two stages, the memory does not depend on the size of the file
+template<int D = 3, class T = float>
+class PointLoader
+{
+    typedef Point<D, T> PointT;
+    string path;
+    PointFormat format;
+    ThreadPool* pool;
+    size_t chunkBytes = size_t(16) << 20;
+    size_t depth = 4;
+
+    ////// parse the lines of [begin, end), end is a line end or the end of the text
+    static void parseLines(const char* begin, const char* end, vector<PointT>& out)
+    {
+        for (const char* p = begin; p < end; ) {
+            const char* eol = (const char*)memchr(p, '\n', end - p);
+            if (!eol) eol = end;
+            const char* q = p;
+            while (q < eol && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+            if (q < eol && (isdigit((unsigned char)*q) || *q == '-' || *q == '+' || *q == '.')) {
+                PointT point;
+                for (int u=0; u<D; u++) {
+                    char* next;
+                    double value = strtod(q, &next);
+                    if (next == q || next > eol) throw "bad point file";
+                    point[u] = T(value);
+                    q = next;
+                    while (q < eol && (*q == ',' || *q == ';' || *q == ' ' || *q == '\t')) q++;
+                }
+                out.push_back(point);
+            }
+            p = eol + 1;
+        }
+    }
+
+    ////// parse a chunk of whole lines, split at line ends into pieces for the pool
+    vector<PointT> parse(const string& chunk) const
+    {
+        vector<PointT> points;
+        size_t numPieces = pool ? pool->size()*4 : 1;
+        if (numPieces == 1 || chunk.size() < (size_t(1) << 16)) {
+            parseLines(chunk.data(), chunk.data() + chunk.size(), points);
+            return points;
+        }
+        vector<size_t> cut(numPieces + 1, chunk.size());
+        cut[0] = 0;
+        for (size_t i=1; i<numPieces; i++) {
+            size_t pos = max(cut[i - 1], chunk.size()*i/numPieces);
+            size_t eol = chunk.find('\n', pos);
+            cut[i] = (eol == string::npos) ? chunk.size() : eol + 1;
+        }
+        vector<vector<PointT>> pieces(numPieces);
+        pool->parallelFor(numPieces, [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) parseLines(chunk.data() + cut[i], chunk.data() + cut[i + 1], pieces[i]);
+        }, 1);
+        size_t total = 0;
+        for (const auto& piece : pieces) total += piece.size();
+        points.reserve(total);
+        for (const auto& piece : pieces) points.insert(points.end(), piece.begin(), piece.end());
+        return points;
+    }
+
+    void readBinary(BoundedQueue<vector<PointT>>& parsed) const
+    {
+        ifstream in(path, ios::binary);
+        if (!in) throw "cannot open point file";
+        size_t perChunk = max<size_t>(1, chunkBytes/sizeof(PointT));
+        while (true) {
+            vector<PointT> batch(perChunk);
+            in.read((char*)batch.data(), perChunk*sizeof(PointT));
+            size_t bytes = in.gcount();
+            if (bytes%sizeof(PointT) != 0) throw "bad point file";
+            batch.resize(bytes/sizeof(PointT));
+            if (batch.empty() || !parsed.push(move(batch))) return;
+        }
+    }
+
+    ////// chunks of whole lines, the part of the last line is carried to the next chunk
+    void readText(BoundedQueue<string>& raw) const
+    {
+        ifstream in(path, ios::binary);
+        if (!in) throw "cannot open point file";
+        string carry;
+        while (true) {
+            string chunk = move(carry);
+            size_t old = chunk.size();
+            chunk.resize(old + chunkBytes);
+            in.read(&chunk[old], chunkBytes);
+            chunk.resize(old + in.gcount());
+            if (chunk.empty()) return;
+            if (in) {
+                size_t eol = chunk.rfind('\n');
+                if (eol != string::npos) {
+                    carry.assign(chunk, eol + 1, string::npos);
+                    chunk.resize(eol + 1);
+                }
+                else {
+                    // a line longer than a chunk, read on
+                    carry = move(chunk);
+                    continue;
+                }
+            }
+            if (!raw.push(move(chunk)) || !in) return;
+        }
+    }
+public:
+    PointLoader(const string& path, ThreadPool* pool = nullptr) : path(path), format(formatOf(path)), pool(pool) {}
+
+    ////// CSV for the extensions .csv and .txt, binary for the others
+    static PointFormat formatOf(const string& path)
+    {
+        size_t dot = path.rfind('.');
+        string ext = (dot == string::npos) ? "" : path.substr(dot);
+        for (char& c : ext) c = tolower((unsigned char)c);
+        return (ext == ".csv" || ext == ".txt") ? POINTS_CSV : POINTS_BINARY;
+    }
+
+    void setFormat(PointFormat format) {this->format = format;}
+    PointFormat getFormat() const {return format;}
+
+    ////// bytes read at once and number of chunks waiting between two stages, the memory is about 2*depth*chunkBytes
+    void setChunkBytes(size_t chunkBytes) {this->chunkBytes = max<size_t>(chunkBytes, sizeof(PointT));}
+    void setDepth(size_t depth) {this->depth = max<size_t>(depth, 1);}
+
+    ////// call consume(batch) for the points of every chunk in file order, batch is a vector<PointT>& the consumer may
+    ////// move from. Return the number of points. An error of any stage stops the others and is thrown here
+    template<class F>
+    size_t forEachBatch(F consume)
+    {
+        BoundedQueue<string> raw(depth);
+        BoundedQueue<vector<PointT>> parsed(depth);
+        exception_ptr error;
+        mutex errorMtx;
+        auto fail = [&]() {
+            {
+                lock_guard<mutex> lock(errorMtx);
+                if (!error) error = current_exception();
+            }
+            raw.close();
+            parsed.close();
+        };
+        vector<thread> stages;
+        if (format == POINTS_BINARY) {
+            stages.push_back(thread([&]() {
+                try {readBinary(parsed);}
+                catch (...) {fail();}
+                parsed.close();
+            }));
+        }
+        else {
+            stages.push_back(thread([&]() {
+                try {readText(raw);}
+                catch (...) {fail();}
+                raw.close();
+            }));
+            stages.push_back(thread([&]() {
+                try {
+                    string chunk;
+                    while (raw.pop(chunk))
+                        if (!parsed.push(parse(chunk))) break;
+                }
+                catch (...) {fail();}
+                raw.close();
+                parsed.close();
+            }));
+        }
+        size_t count = 0;
+        try {
+            vector<PointT> batch;
+            while (parsed.pop(batch)) {
+                count += batch.size();
+                consume(batch);
+            }
+        }
+        catch (...) {fail();}
+        raw.close();
+        parsed.close();
+        for (thread& t : stages) t.join();
+        if (error) rethrow_exception(error);
+        return count;
+    }
+
+    ////// all points of the file, e.g. for KDTree::build
+    vector<PointT> readAll()
+    {
+        vector<PointT> points;
+        if (format == POINTS_BINARY) {
+            ifstream in(path, ios::binary | ios::ate);
+            if (in) points.reserve(size_t(in.tellg())/sizeof(PointT));
+        }
+        forEachBatch([&](vector<PointT>& batch) {points.insert(points.end(), batch.begin(), batch.end());});
+        return points;
+    }
+
+    ////// write points in a format PointLoader reads
+    static void write(const string& path, const vector<PointT>& points, PointFormat format)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) throw "cannot open point file";
+        if (format == POINTS_BINARY) out.write((const char*)points.data(), points.size()*sizeof(PointT));
+        else {
+            out << setprecision(numeric_limits<T>::max_digits10);
+            for (const PointT& p : points) {
+                for (int u=0; u<D; u++) out << (u ? "," : "") << p[u];
+                out << "\n";
+            }
+        }
+        out.close();
+        if (!out) throw "cannot write point file";
+    }
+};
+
+#endif // POINTLOADER_H
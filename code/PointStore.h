@@ -0,0 +1,162 @@
+#ifndef POINTSTORE_H
+#define POINTSTORE_H
+
+#include "point&plane.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+////// owner of the points of an index, every point gets a 32-bit id
+////// the id and the address of a point never change until it is released
+template<class P>
+class PointStore
+{
+    static const int CHUNKBITS = 12;
+    static const uint32_t CHUNKSIZE = 1 << CHUNKBITS;
+    vector<P> base; // points moved in at once, never resized after that
+    const P* baseData = nullptr; // the points of base, or of a read only array given to map
+    uint32_t baseSize = 0;
+    bool mapped = 0;
+    vector<unique_ptr<P[]>> chunks; // points added one by one, every chunk holds CHUNKSIZE points
+    uint32_t count = 0; // ids in [0, count) have been given
+    vector<uint32_t> freeIds; // released ids, they are given again before new ones
+    vector<bool> released;
+    uint32_t numReleased = 0;
+
+    P& slot(uint32_t id)
+    {
+        if (id < baseSize) return base[id]; // never a mapped id, they are not given again
+        uint32_t i = id - baseSize;
+        return chunks[i >> CHUNKBITS][i & (CHUNKSIZE - 1)];
+    }
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    PointStore() {}
+    PointStore(const PointStore&) = delete;
+    PointStore& operator=(const PointStore&) = delete;
+
+    const P& operator[](uint32_t id) const
+    {
+        if (id < baseSize) return baseData[id];
+        uint32_t i = id - baseSize;
+        return chunks[i >> CHUNKBITS][i & (CHUNKSIZE - 1)];
+    }
+
+    ////// copy a point into the store, return its id
+    uint32_t add(const P& p)
+    {
+        uint32_t id;
+        if (!freeIds.empty()) {
+            id = freeIds.back();
+            freeIds.pop_back();
+            released[id] = 0;
+            numReleased--;
+        }
+        else {
+            if (count == NONE) throw "point store is full";
+            id = count++;
+            released.push_back(0);
+            uint32_t i = id - baseSize;
+            if ((i >> CHUNKBITS) >= chunks.size()) chunks.push_back(unique_ptr<P[]>(new P[CHUNKSIZE]));
+        }
+        slot(id) = p;
+        return id;
+    }
+
+    ////// take all points of an empty store without copying, their ids are 0 .. points.size() - 1
+    void assign(vector<P>&& points)
+    {
+        if (count > 0) throw "point store is not empty";
+        if (points.size() >= NONE) throw "point store is full";
+        base = move(points);
+        baseData = base.data();
+        baseSize = count = base.size();
+        released.assign(count, 0);
+    }
+
+    ////// use a read only array of an empty store without copying, e.g. a memory mapped snapshot,
+    ////// the array must outlive the store. Points added later go to the chunks as usual
+    void map(const P* points, uint32_t size)
+    {
+        if (count > 0) throw "point store is not empty";
+        if (size >= NONE) throw "point store is full";
+        baseData = points;
+        baseSize = count = size;
+        mapped = 1;
+        released.assign(count, 0);
+    }
+
+    bool isMapped() const {return mapped;}
+
+    void release(uint32_t id)
+    {
+        if (id >= count || released[id]) return;
+        released[id] = 1;
+        numReleased++;
+        // a mapped point cannot be overwritten, its id is never given again
+        if (!(mapped && id < baseSize)) freeIds.push_back(id);
+    }
+
+    bool alive(uint32_t id) const {return id < count && !released[id];}
+
+    uint32_t size() const {return count;} // ids are smaller than size()
+    size_t live() const {return count - numReleased;}
+
+    void clear()
+    {
+        vector<P>().swap(base);
+        baseData = nullptr;
+        baseSize = 0;
+        mapped = 0;
+        chunks.clear();
+        freeIds.clear();
+        released.clear();
+        numReleased = 0;
+        count = 0;
+    }
+
+    size_t memoryUsage() const
+    {
+        return base.capacity()*sizeof(P) + chunks.size()*CHUNKSIZE*sizeof(P)
+            + freeIds.capacity()*sizeof(uint32_t) + released.capacity()/8;
+    }
+};
+
+////// ids of the points checked by one query, clearing the set is O(1) by starting a new epoch
+class VisitedSet
+{
+    vector<uint32_t> stamp; // stamp[id] == epoch if id was visited in this query
+    uint32_t epoch = 0;
+public:
+    ////// start a new query for ids smaller than size
+    void reset(uint32_t size)
+    {
+        if (stamp.size() < size) stamp.resize(size, 0);
+        if (++epoch == 0) {
+            fill(stamp.begin(), stamp.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    ////// return 1 if id was not visited yet
+    bool insert(uint32_t id)
+    {
+        if (stamp[id] == epoch) return 0;
+        stamp[id] = epoch;
+        return 1;
+    }
+
+    ////// the set of the calling thread, so const queries can run in parallel
+    static VisitedSet& local(uint32_t size)
+    {
+        static thread_local VisitedSet visited;
+        visited.reset(size);
+        return visited;
+    }
+};
+
+#endif // POINTSTORE_H
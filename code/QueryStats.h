@@ -0,0 +1,153 @@
+#ifndef QUERYSTATS_H
+#define QUERYSTATS_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+////// query counters of KDTree, BoxKDTree and LSH, compiled only with -DQUERY_STATS.
+////// Every thread counts into its own QueryStats without any lock, QueryStats::total() adds the counters of
+////// all threads and can be called at any time, e.g. by a thread that exports them
+struct QueryStats
+{
+    enum Counter
+    {
+        QUERIES, // nearest, kNN and radius queries
+        NODES_VISITED, // tree nodes entered
+        DISTANCE_EVALS, // square distances from the key to a point
+        BUCKETS_PROBED, // hash buckets scanned, the buckets of key and the extra ones
+        EXTRA_PROBES, // buckets scanned by multi-probe
+        CANDIDATES_DEDUPED, // points skipped because they were already checked in another table
+        FULL_SCANS, // LSH queries that found nothing and scanned a whole table
+        NUM_COUNTERS
+    };
+
+    static const char* name(int c)
+    {
+        static const char* names[NUM_COUNTERS] = {"queries", "nodes_visited", "distance_evals", "buckets_probed",
+                                                  "extra_probes", "candidates_deduped", "full_scans"};
+        return names[c];
+    }
+
+    // only the owner thread writes, so a relaxed load and store is enough and costs the same as a plain add
+    atomic<uint64_t> counter[NUM_COUNTERS];
+
+    QueryStats() {reset();}
+    QueryStats(const QueryStats& s) {for (int c=0; c<NUM_COUNTERS; c++) counter[c].store(s.get(c), memory_order_relaxed);}
+
+    uint64_t get(int c) const {return counter[c].load(memory_order_relaxed);}
+
+    void add(int c, uint64_t n) {counter[c].store(get(c) + n, memory_order_relaxed);}
+
+    void reset() {for (int c=0; c<NUM_COUNTERS; c++) counter[c].store(0, memory_order_relaxed);}
+
+    QueryStats& operator+=(const QueryStats& s)
+    {
+        for (int c=0; c<NUM_COUNTERS; c++) add(c, s.get(c));
+        return *this;
+    }
+
+    ////// one line per counter, "prefix_name value"
+    void write(ostream& out, const string& prefix = "kdth") const
+    {
+        for (int c=0; c<NUM_COUNTERS; c++) out << prefix << "_" << name(c) << " " << get(c) << "\n";
+    }
+
+    ////// the counters of the calling thread
+    static QueryStats& local();
+
+    ////// the sum of the counters of all threads, finished threads included
+    static QueryStats total();
+
+    ////// set the counters of all threads to 0. Only call it while no query runs: an owner adds with a relaxed load
+    ////// and store, so a count it has loaded before the reset would be stored back over the 0
+    static void resetAll();
+};
+
+////// the counters of all threads which have counted
+struct QueryStatsRegistry
+{
+    mutex mtx;
+    vector<QueryStats*> live;
+    QueryStats finished; // counters of the threads which have ended
+
+    static QueryStatsRegistry& get()
+    {
+        static QueryStatsRegistry* r = new QueryStatsRegistry(); // never destroyed, threads may end after main
+        return *r;
+    }
+
+    ////// the counters of one thread, they are added to finished when the thread ends
+    struct Entry
+    {
+        QueryStats stats;
+        Entry()
+        {
+            QueryStatsRegistry& r = get();
+            lock_guard<mutex> lock(r.mtx);
+            r.live.push_back(&stats);
+        }
+        ~Entry()
+        {
+            QueryStatsRegistry& r = get();
+            lock_guard<mutex> lock(r.mtx);
+            r.finished += stats;
+            r.live.erase(find(r.live.begin(), r.live.end(), &stats));
+        }
+    };
+};
+
+inline QueryStats& QueryStats::local()
+{
+    static thread_local QueryStatsRegistry::Entry entry;
+    return entry.stats;
+}
+
+inline QueryStats QueryStats::total()
+{
+    QueryStatsRegistry& r = QueryStatsRegistry::get();
+    lock_guard<mutex> lock(r.mtx);
+    QueryStats sum(r.finished);
+    for (QueryStats* s : r.live) sum += *s;
+    return sum;
+}
+
+inline void QueryStats::resetAll()
+{
+    QueryStatsRegistry& r = QueryStatsRegistry::get();
+    lock_guard<mutex> lock(r.mtx);
+    r.finished.reset();
+    for (QueryStats* s : r.live) s->reset();
+}
+
+#ifdef QUERY_STATS
+#define STATS_ADD(counter, n) QueryStats::local().add(QueryStats::counter, n)
+#else
+#define STATS_ADD(counter, n) ((void)sizeof(n)) // n is not evaluated
+#endif
+
+////// histogram with power of two bins: bin 0 counts the value 0, bin i counts values in [2^(i-1), 2^i)
+inline void addToLog2Histogram(vector<size_t>& hist, size_t value)
+{
+    size_t bin = 0;
+    while (value >> bin) bin++;
+    if (hist.size() <= bin) hist.resize(bin + 1, 0);
+    hist[bin]++;
+}
+
+inline void printLog2Histogram(ostream& out, const vector<size_t>& hist)
+{
+    for (size_t i=0; i<hist.size(); i++) {
+        if (i == 0) out << "  0";
+        else out << "  [" << (size_t(1) << (i - 1)) << ", " << (size_t(1) << i) << ")";
+        out << ": " << hist[i] << "\n";
+    }
+}
+
+#endif // QUERYSTATS_H
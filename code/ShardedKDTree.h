@@ -0,0 +1,346 @@
+#ifndef SHARDEDKDTREE_H
+#define SHARDEDKDTREE_H
+
+#include "point&plane.h"
+#include "ThreadPool.h"
+#include "KDTree.h"
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <mutex>
+#include <thread>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+////// KD Trees of disjoint regions of space: a few cuts at the top split space into boxes, every box has its own tree
+////// and its own lock. An insert or a remove locks only the tree of its point, so writers of different regions run
+////// at the same time, and a query only visits the trees whose box can hold a result.
+////// Queries, insert and remove may be called from many threads at once, build and clear may not
+template<int D = 3, class T = float>
+class ShardedKDTree
+{
+    typedef Point<D, T> PointT;
+    struct Shard
+    {
+        KDTree<D, T> tree;
+        T lo[D], hi[D]; // the region of the shard, the sides at the border of space are infinite
+        mutable shared_mutex mtx;
+    };
+    ////// a cut sends points with p[d] < value to left, the others to right, a child c < 0 is the shard ~c
+    struct Cut
+    {
+        int d;
+        T value;
+        int left, right;
+    };
+    vector<unique_ptr<Shard>> shards;
+    vector<Cut> cuts; // cuts[0] is the first cut, there is no cut with one shard
+    size_t wanted; // number of shards
+    int bot, top;
+
+    ////// split region [lo, hi] into count shards. With points in [begin, end) a cut is at the point of the right rank
+    ////// on their widest coordinate, so the shards get the same number of points, otherwise the widest side of
+    ////// [bot, top]^D is cut in proportion. Return the child to put into the parent cut
+    int cutRec(T* lo, T* hi, T* extentLo, T* extentHi, PointT* begin, PointT* end, size_t count)
+    {
+        if (count == 1) {
+            shards.push_back(unique_ptr<Shard>(new Shard()));
+            copy(lo, lo + D, shards.back()->lo);
+            copy(hi, hi + D, shards.back()->hi);
+            return ~int(shards.size() - 1);
+        }
+        size_t leftCount = count/2;
+        Cut cut;
+        PointT* mid = nullptr;
+        if (end - begin >= 2) {
+            T minv[D], maxv[D];
+            for (int u=0; u<D; u++) {
+                minv[u] = numeric_limits<T>::max();
+                maxv[u] = numeric_limits<T>::lowest();
+            }
+            for (PointT* p = begin; p < end; p++) {
+                for (int u=0; u<D; u++) {
+                    minv[u] = min(minv[u], (*p)[u]);
+                    maxv[u] = max(maxv[u], (*p)[u]);
+                }
+            }
+            cut.d = 0;
+            for (int u=1; u<D; u++)
+                if (maxv[u] - minv[u] > maxv[cut.d] - minv[cut.d]) cut.d = u;
+            mid = begin + (end - begin)*leftCount/count;
+            int d = cut.d;
+            nth_element(begin, mid, end, [d](const PointT& a, const PointT& b) {return a[d] < b[d];});
+            cut.value = (*mid)[d];
+        }
+        else {
+            cut.d = 0;
+            for (int u=1; u<D; u++)
+                if (extentHi[u] - extentLo[u] > extentHi[cut.d] - extentLo[cut.d]) cut.d = u;
+            cut.value = extentLo[cut.d] + (extentHi[cut.d] - extentLo[cut.d])*leftCount/count;
+            begin = end = nullptr;
+        }
+        int index = cuts.size();
+        cuts.push_back(cut);
+        int d = cut.d;
+        T saved = hi[d], savedExtent = extentHi[d];
+        hi[d] = extentHi[d] = cut.value;
+        int left = cutRec(lo, hi, extentLo, extentHi, begin, mid, leftCount);
+        hi[d] = saved;
+        extentHi[d] = savedExtent;
+        saved = lo[d];
+        savedExtent = extentLo[d];
+        lo[d] = extentLo[d] = cut.value;
+        int right = cutRec(lo, hi, extentLo, extentHi, mid, end, count - leftCount);
+        lo[d] = saved;
+        extentLo[d] = savedExtent;
+        cuts[index].left = left;
+        cuts[index].right = right;
+        return index;
+    }
+
+    ////// make the shards, empty, from points if there are enough of them, otherwise from [bot, top]^D
+    void makeShards(vector<PointT>& points)
+    {
+        shards.clear();
+        cuts.clear();
+        T lo[D], hi[D], extentLo[D], extentHi[D];
+        for (int u=0; u<D; u++) {
+            lo[u] = numeric_limits<T>::lowest();
+            hi[u] = numeric_limits<T>::max();
+            extentLo[u] = bot;
+            extentHi[u] = top;
+        }
+        bool fromPoints = points.size() >= 2*wanted;
+        cutRec(lo, hi, extentLo, extentHi, fromPoints ? points.data() : nullptr,
+               fromPoints ? points.data() + points.size() : nullptr, wanted);
+    }
+
+    ////// square distance from key to the region of shard s, 0 if key is inside
+    T regionDistance(const Shard& s, const PointT& key) const
+    {
+        T dis = 0;
+        for (int u=0; u<D; u++) {
+            T diff = max(s.lo[u] - key[u], max(T(0), key[u] - s.hi[u]));
+            dis += diff*diff;
+        }
+        return dis;
+    }
+
+    ////// shards sorted by the distance from key to their region, the ones farther than maxSquareDis are left out
+    vector<pair<T, size_t>> shardsNear(const PointT& key, T maxSquareDis) const
+    {
+        vector<pair<T, size_t>> order;
+        for (size_t s=0; s<shards.size(); s++) {
+            T dis = regionDistance(*shards[s], key);
+            if (dis <= maxSquareDis) order.push_back(make_pair(dis, s));
+        }
+        sort(order.begin(), order.end());
+        return order;
+    }
+public:
+    ////// numShards regions made by cutting [bot, top]^D, build cuts them again at the medians of its points
+    ShardedKDTree(size_t numShards = thread::hardware_concurrency(), int bot = 0, int top = 100)
+        : wanted(max<size_t>(numShards, 1)), bot(bot), top(top)
+    {
+        vector<PointT> none;
+        makeShards(none);
+    }
+
+    ShardedKDTree(const ShardedKDTree&) = delete;
+    ShardedKDTree& operator=(const ShardedKDTree&) = delete;
+
+    ////// the shard whose region holds p
+    size_t shardOf(const PointT& p) const
+    {
+        if (cuts.empty()) return 0;
+        int x = 0;
+        while (true) {
+            const Cut& c = cuts[x];
+            x = (p[c.d] < c.value) ? c.left : c.right;
+            if (x < 0) return ~x;
+        }
+    }
+
+    size_t numShards() const {return shards.size();}
+
+    size_t shardSize(size_t s) const
+    {
+        shared_lock<shared_mutex> lock(shards[s]->mtx);
+        return shards[s]->tree.getSize();
+    }
+
+    ////// cut space at the medians of the points and build the trees of all shards, on pool if it is given
+    void build(const vector<PointT>& points, ThreadPool* pool = nullptr)
+    {
+        build(vector<PointT>(points), pool);
+    }
+
+    void build(vector<PointT>&& points, ThreadPool* pool = nullptr)
+    {
+        makeShards(points);
+        vector<vector<PointT>> parts(shards.size());
+        for (const PointT& p : points) parts[shardOf(p)].push_back(p);
+        vector<PointT>().swap(points);
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t s=lo; s<hi; s++) shards[s]->tree.build(move(parts[s]));
+        };
+        if (pool) pool->parallelFor(shards.size(), body, 1);
+        else body(0, shards.size());
+    }
+
+    void clear()
+    {
+        for (auto& s : shards) s->tree.clear();
+    }
+
+    void insert(const PointT& p)
+    {
+        Shard& s = *shards[shardOf(p)];
+        unique_lock<shared_mutex> lock(s.mtx);
+        s.tree.insert(p);
+    }
+
+    ////// insert points grouped by shard, the shards are filled at the same time on pool if it is given
+    void insertBatch(const vector<PointT>& points, ThreadPool* pool = nullptr)
+    {
+        vector<vector<uint32_t>> parts(shards.size());
+        for (size_t i=0; i<points.size(); i++) parts[shardOf(points[i])].push_back(i);
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t s=lo; s<hi; s++) {
+                if (parts[s].empty()) continue;
+                unique_lock<shared_mutex> lock(shards[s]->mtx);
+                for (uint32_t i : parts[s]) shards[s]->tree.insert(points[i]);
+            }
+        };
+        if (pool) pool->parallelFor(shards.size(), body, 1);
+        else body(0, shards.size());
+    }
+
+    void remove(const PointT& p)
+    {
+        Shard& s = *shards[shardOf(p)];
+        unique_lock<shared_mutex> lock(s.mtx);
+        s.tree.remove(p);
+    }
+
+    bool search(const PointT& key) const
+    {
+        const Shard& s = *shards[shardOf(key)];
+        shared_lock<shared_mutex> lock(s.mtx);
+        return s.tree.search(key);
+    }
+
+    int getSize() const
+    {
+        int size = 0;
+        for (size_t s=0; s<shards.size(); s++) size += shardSize(s);
+        return size;
+    }
+
+    ////// the shard of key first, then the others nearest first until a region is farther than the best point
+    PointT nearestPoint(const PointT& key) const
+    {
+        PointT best;
+        T bestDis = numeric_limits<T>::max();
+        bool found = 0;
+        for (const auto& item : shardsNear(key, numeric_limits<T>::max())) {
+            if (found && item.first >= bestDis) break;
+            const Shard& s = *shards[item.second];
+            shared_lock<shared_mutex> lock(s.mtx);
+            NearestResult<PointT> r = s.tree.nearest(key);
+            if (r.point && r.squareDistance < bestDis) {
+                best = *r.point;
+                bestDis = r.squareDistance;
+                found = 1;
+            }
+        }
+        if (!found) throw "empty tree";
+        return best;
+    }
+
+    vector<PointT> kNearest(const PointT& key, size_t kn) const
+    {
+        vector<pair<T, PointT>> cand;
+        T bound = numeric_limits<T>::max(); // the k-th distance found so far
+        for (const auto& item : shardsNear(key, numeric_limits<T>::max())) {
+            if (item.first >= bound) break;
+            const Shard& s = *shards[item.second];
+            shared_lock<shared_mutex> lock(s.mtx);
+            for (const PointT& p : s.tree.kNearest(key, kn)) cand.push_back(make_pair(key.squareDistance(p), p));
+            lock.unlock();
+            if (cand.size() >= kn && kn > 0) {
+                nth_element(cand.begin(), cand.begin() + (kn - 1), cand.end(),
+                            [](const pair<T, PointT>& a, const pair<T, PointT>& b) {return a.first < b.first;});
+                cand.resize(kn);
+                bound = cand[kn - 1].first;
+            }
+        }
+        sort(cand.begin(), cand.end(), [](const pair<T, PointT>& a, const pair<T, PointT>& b) {return a.first < b.first;});
+        if (cand.size() > kn) cand.resize(kn);
+        vector<PointT> res;
+        for (const auto& c : cand) res.push_back(c.second);
+        return res;
+    }
+
+    ////// points in the distance from the shards whose region meets the ball, searched at the same time on pool if it
+    ////// is given and there are several of them
+    vector<PointT> closePoint(const PointT& key, T maxDis = 0, ThreadPool* pool = nullptr) const
+    {
+        vector<pair<T, size_t>> near = shardsNear(key, maxDis*maxDis);
+        vector<vector<PointT>> parts(near.size());
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) {
+                const Shard& s = *shards[near[i].second];
+                shared_lock<shared_mutex> lock(s.mtx);
+                parts[i] = s.tree.closePoint(key, maxDis);
+            }
+        };
+        if (pool && near.size() > 1) pool->parallelFor(near.size(), body, 1);
+        else body(0, near.size());
+        if (parts.size() == 1) return move(parts[0]);
+        vector<PointT> arr;
+        for (const auto& part : parts) arr.insert(arr.end(), part.begin(), part.end());
+        return arr;
+    }
+
+    size_t countInRadius(const PointT& key, T maxDis) const
+    {
+        size_t count = 0;
+        for (const auto& item : shardsNear(key, maxDis*maxDis)) {
+            const Shard& s = *shards[item.second];
+            shared_lock<shared_mutex> lock(s.mtx);
+            count += s.tree.countInRadius(key, maxDis);
+        }
+        return count;
+    }
+
+    ///////////////// answer a batch of queries, out must have room for n results, run on pool if it is given
+    void nearestPointBatch(const PointT* keys, size_t n, PointT* out, ThreadPool* pool = nullptr) const
+    {
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = nearestPoint(keys[i]);
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    void closePointBatch(const PointT* keys, size_t n, T maxDis, vector<PointT>* out, ThreadPool* pool = nullptr) const
+    {
+        auto body = [&](size_t lo, size_t hi) {
+            for (size_t i=lo; i<hi; i++) out[i] = closePoint(keys[i], maxDis);
+        };
+        if (pool) pool->parallelFor(n, body);
+        else body(0, n);
+    }
+
+    ////// number of points of every shard
+    void printStats(ostream& out = cout) const
+    {
+        out << "SHARDED KD TREE: " << getSize() << " points in " << shards.size() << " shards\n";
+        for (size_t s=0; s<shards.size(); s++) out << "  shard " << s << ": " << shardSize(s) << "\n";
+    }
+};
+
+#endif // SHARDEDKDTREE_H
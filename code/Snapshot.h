@@ -0,0 +1,186 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_MMAP 1
+#endif
+
+using namespace std;
+
+////// binary snapshot of an index: one header followed by sections, every section starts at a multiple of 64 bytes
+////// so the arrays in it can be used in place when the file is memory mapped.
+////// Numbers are stored in the byte order of the machine, a snapshot made on another byte order is rejected
+enum SnapshotKind {SNAPSHOT_KDTREE = 1, SNAPSHOT_FLATKDTREE = 2, SNAPSHOT_LSH = 3};
+
+struct SnapshotHeader
+{
+    static const uint32_t VERSION = 2; // 2: LSH tables grow by linear hashing
+    ////// the oldest version whose sections of the kind are still read, a change of one kind does not reject the others
+    static uint32_t oldestVersion(uint32_t kind) {return kind == SNAPSHOT_LSH ? 2 : 1;}
+    static const int MAXSECTIONS = 16;
+    char magic[8] = {'K', 'D', 'T', 'H', 'S', 'N', 'A', 'P'};
+    uint32_t byteOrder = 0x01020304;
+    uint32_t version = VERSION;
+    uint32_t kind = 0; // SnapshotKind
+    uint32_t dim = 0; // number of coordinates of a point
+    uint32_t scalarSize = 0; // sizeof the coordinate type
+    uint32_t numSections = 0;
+    uint64_t fileSize = 0;
+    uint64_t offset[MAXSECTIONS] = {}; // section i is bytes [offset[i], offset[i] + size[i]) of the file
+    uint64_t size[MAXSECTIONS] = {};
+};
+
+////// write a snapshot section by section, a section may be written in several pieces
+class SnapshotWriter
+{
+    ofstream out;
+    SnapshotHeader header;
+    uint64_t pos = 0;
+public:
+    SnapshotWriter(const string& path, SnapshotKind kind, int dim, int scalarSize)
+    {
+        out.open(path, ios::binary | ios::trunc);
+        if (!out) throw "cannot open snapshot";
+        header.kind = kind;
+        header.dim = dim;
+        header.scalarSize = scalarSize;
+        // the header is written again with the offsets when the snapshot is finished
+        out.write((const char*)&header, sizeof(header));
+        pos = sizeof(header);
+    }
+
+    void beginSection()
+    {
+        if (header.numSections == SnapshotHeader::MAXSECTIONS) throw "too many snapshot sections";
+        static const char zeros[64] = {};
+        uint64_t pad = (64 - pos%64)%64;
+        out.write(zeros, pad);
+        pos += pad;
+        header.offset[header.numSections] = pos;
+        header.size[header.numSections] = 0;
+        header.numSections++;
+    }
+
+    void write(const void* data, size_t bytes)
+    {
+        out.write((const char*)data, bytes);
+        pos += bytes;
+        header.size[header.numSections - 1] += bytes;
+    }
+
+    void section(const void* data, size_t bytes)
+    {
+        beginSection();
+        write(data, bytes);
+    }
+
+    void finish()
+    {
+        header.fileSize = pos;
+        out.seekp(0);
+        out.write((const char*)&header, sizeof(header));
+        out.close();
+        if (!out) throw "cannot write snapshot";
+    }
+};
+
+////// a snapshot opened read only, it is memory mapped where mmap exists, otherwise it is read into memory.
+////// Indexes loaded from it keep a shared_ptr to it, the arrays they use stay valid as long as one of them is alive
+class Snapshot
+{
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool mapped = 0;
+    unique_ptr<uint64_t[]> buffer; // used when the file is read, not mapped
+    SnapshotHeader header;
+
+    Snapshot() {}
+public:
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    ~Snapshot()
+    {
+#ifdef SNAPSHOT_MMAP
+        if (mapped) munmap((void*)bytes, length);
+#endif
+    }
+
+    ////// open path and check that it is a snapshot of the given kind, dimension and coordinate size
+    static shared_ptr<const Snapshot> open(const string& path, SnapshotKind kind, int dim, int scalarSize)
+    {
+        shared_ptr<Snapshot> s(new Snapshot());
+#ifdef SNAPSHOT_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw "cannot open snapshot";
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SnapshotHeader)) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                s->bytes = (const char*)p;
+                s->length = st.st_size;
+                s->mapped = 1;
+            }
+        }
+        close(fd);
+#endif
+        if (!s->mapped) {
+            ifstream in(path, ios::binary | ios::ate);
+            if (!in) throw "cannot open snapshot";
+            s->length = in.tellg();
+            s->buffer.reset(new uint64_t[s->length/8 + 1]);
+            in.seekg(0);
+            in.read((char*)s->buffer.get(), s->length);
+            if (!in) throw "cannot read snapshot";
+            s->bytes = (const char*)s->buffer.get();
+        }
+
+        if (s->length < sizeof(SnapshotHeader)) throw "bad snapshot";
+        memcpy(&s->header, s->bytes, sizeof(SnapshotHeader));
+        const SnapshotHeader& h = s->header;
+        if (memcmp(h.magic, SnapshotHeader().magic, sizeof(h.magic)) != 0) throw "bad snapshot";
+        if (h.byteOrder != SnapshotHeader().byteOrder) throw "snapshot has another byte order";
+        if (h.kind != uint32_t(kind) || h.dim != uint32_t(dim) || h.scalarSize != uint32_t(scalarSize))
+            throw "snapshot does not match the index";
+        if (h.version < SnapshotHeader::oldestVersion(h.kind) || h.version > SnapshotHeader::VERSION)
+            throw "snapshot version is not supported";
+        if (h.fileSize != s->length || h.numSections > uint32_t(SnapshotHeader::MAXSECTIONS)) throw "bad snapshot";
+        for (uint32_t i=0; i<h.numSections; i++) {
+            if (h.offset[i]%64 != 0 || h.offset[i] > s->length || h.size[i] > s->length - h.offset[i])
+                throw "bad snapshot";
+        }
+        return s;
+    }
+
+    uint32_t numSections() const {return header.numSections;}
+
+    ////// section i as an array of count elements of type X
+    template<class X>
+    const X* array(uint32_t i, size_t count) const
+    {
+        if (i >= header.numSections || header.size[i] != count*sizeof(X)) throw "bad snapshot";
+        return (const X*)(bytes + header.offset[i]);
+    }
+
+    ////// number of elements of type X in section i
+    template<class X>
+    size_t count(uint32_t i) const
+    {
+        if (i >= header.numSections || header.size[i]%sizeof(X) != 0) throw "bad snapshot";
+        return header.size[i]/sizeof(X);
+    }
+
+    bool isMapped() const {return mapped;}
+};
+
+#endif // SNAPSHOT_H
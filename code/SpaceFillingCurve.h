@@ -0,0 +1,101 @@
+#ifndef SPACEFILLINGCURVE_H
+#define SPACEFILLINGCURVE_H
+
+#include <vector>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+using namespace std;
+
+////// order of points along a space filling curve: points near each other on the curve are near each other in space,
+////// so storing points in this order puts the points of a KD Tree leaf or of an LSH bucket on the same cache lines.
+////// Morton (Z order) interleaves the bits of the coordinates, Hilbert also turns the cells so the curve never jumps
+enum CurveKind {CURVE_NONE, CURVE_MORTON, CURVE_HILBERT};
+
+////// the key has up to 64 bits: 64/D bits of every coordinate but at most 32, one bit of the first 64 coordinates if D > 64
+template<int D>
+struct CurveBits
+{
+    static const int DIMS = D < 64 ? D : 64;
+    static const int BITS = D < 64 ? min(32, 64/D) : 1;
+};
+
+////// Skilling's transform of cell coordinates x[0 .. n) with b bits each into the transposed Hilbert index
+inline void hilbertTranspose(uint32_t* x, int b, int n)
+{
+    uint32_t m = uint32_t(1) << (b - 1);
+    // inverse undo
+    for (uint32_t q = m; q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int i=0; i<n; i++) {
+            // invert if bit q of x[i] is set, exchange otherwise, without a branch the random bits cannot mispredict
+            uint32_t set = 0 - uint32_t((x[i] & q) != 0);
+            x[0] ^= p & set;
+            uint32_t t = (x[0] ^ x[i]) & p & ~set;
+            x[0] ^= t;
+            x[i] ^= t;
+        }
+    }
+    // gray encode
+    for (int i=1; i<n; i++) x[i] ^= x[i - 1];
+    uint32_t t = 0;
+    for (uint32_t q = m; q > 1; q >>= 1)
+        if (x[n - 1] & q) t ^= q - 1;
+    for (int i=0; i<n; i++) x[i] ^= t;
+}
+
+////// key of point p in the box [lo, hi]
+template<class P>
+uint64_t curveKey(const P& p, const P& lo, const P& hi, CurveKind kind)
+{
+    const int n = CurveBits<P::dim>::DIMS, b = CurveBits<P::dim>::BITS;
+    const uint64_t top = (uint64_t(1) << b) - 1;
+    uint32_t x[n];
+    for (int u=0; u<n; u++) {
+        double side = double(hi[u]) - double(lo[u]);
+        double cell = side > 0 ? (double(p[u]) - double(lo[u]))/side*top : 0;
+        x[u] = uint32_t(min<double>(double(top), max<double>(0, cell)));
+    }
+    if (kind == CURVE_HILBERT) hilbertTranspose(x, b, n);
+    // interleave the bits, the highest bit of every coordinate first
+    uint64_t key = 0;
+    for (int bit=b-1; bit>=0; bit--)
+        for (int u=0; u<n; u++) key = (key << 1) | ((x[u] >> bit) & 1);
+    return key;
+}
+
+////// permutation of points along the curve over their bounding box, order[i] is the index of the i-th point
+template<class P>
+vector<uint32_t> curveOrder(const vector<P>& points, CurveKind kind)
+{
+    vector<uint32_t> order(points.size());
+    for (uint32_t i=0; i<order.size(); i++) order[i] = i;
+    if (kind == CURVE_NONE || points.empty()) return order;
+    P lo = points[0], hi = points[0];
+    for (const P& p : points) {
+        for (int u=0; u<P::dim; u++) {
+            lo[u] = min(lo[u], p[u]);
+            hi[u] = max(hi[u], p[u]);
+        }
+    }
+    vector<pair<uint64_t, uint32_t>> keys(points.size());
+    for (uint32_t i=0; i<keys.size(); i++) keys[i] = make_pair(curveKey(points[i], lo, hi, kind), i);
+    sort(keys.begin(), keys.end());
+    for (uint32_t i=0; i<keys.size(); i++) order[i] = keys[i].second;
+    return order;
+}
+
+////// reorder points along the curve
+template<class P>
+void sortByCurve(vector<P>& points, CurveKind kind)
+{
+    if (kind == CURVE_NONE) return;
+    vector<uint32_t> order = curveOrder(points, kind);
+    vector<P> sorted;
+    sorted.reserve(points.size());
+    for (uint32_t i : order) sorted.push_back(points[i]);
+    points.swap(sorted);
+}
+
+#endif // SPACEFILLINGCURVE_H
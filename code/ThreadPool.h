@@ -0,0 +1,132 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+////// pool of worker threads, every worker has its own task queue and steals from the others when it is empty
+class ThreadPool
+{
+    struct Worker
+    {
+        deque<function<void()>> tasks;
+        mutex mtx;
+    };
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    mutex sleepMtx;
+    condition_variable sleepCv;
+    atomic<size_t> queued{0}; // number of tasks waiting in all queues
+    atomic<size_t> nextWorker{0};
+    bool stop = false;
+
+    bool popTask(size_t self, function<void()>& task)
+    {
+        // own queue first, newest task is the hottest in cache
+        {
+            Worker& w = *workers[self];
+            lock_guard<mutex> lock(w.mtx);
+            if (!w.tasks.empty()) {
+                task = move(w.tasks.back());
+                w.tasks.pop_back();
+                queued--;
+                return 1;
+            }
+        }
+        // steal the oldest task of another worker
+        for (size_t i=1; i<workers.size(); i++) {
+            Worker& w = *workers[(self + i)%workers.size()];
+            lock_guard<mutex> lock(w.mtx);
+            if (!w.tasks.empty()) {
+                task = move(w.tasks.front());
+                w.tasks.pop_front();
+                queued--;
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    void run(size_t self)
+    {
+        function<void()> task;
+        while (true) {
+            if (popTask(self, task)) {
+                task();
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMtx);
+            sleepCv.wait(lock, [this]() {return stop || queued > 0;});
+            if (stop && queued == 0) return;
+        }
+    }
+
+public:
+    ThreadPool(size_t numThreads = thread::hardware_concurrency())
+    {
+        if (numThreads == 0) numThreads = 1;
+        for (size_t i=0; i<numThreads; i++) workers.push_back(unique_ptr<Worker>(new Worker()));
+        for (size_t i=0; i<numThreads; i++) threads.push_back(thread(&ThreadPool::run, this, i));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(sleepMtx);
+            stop = 1;
+        }
+        sleepCv.notify_all();
+        for (thread& t : threads) t.join();
+    }
+
+    size_t size() const {return workers.size();}
+
+    ////// push a task to the queues in round robin
+    void submit(function<void()> task)
+    {
+        Worker& w = *workers[nextWorker++%workers.size()];
+        {
+            // count the task before it is visible, so queued never goes below zero
+            lock_guard<mutex> lock(sleepMtx);
+            queued++;
+        }
+        {
+            lock_guard<mutex> lock(w.mtx);
+            w.tasks.push_back(move(task));
+        }
+        sleepCv.notify_one();
+    }
+
+    ////// call body(lo, hi) on chunks of [0, n) and wait for all of them, must not be called from a task of this pool
+    void parallelFor(size_t n, const function<void(size_t, size_t)>& body, size_t grain = 0)
+    {
+        if (n == 0) return;
+        // several chunks per worker so that stealing can balance uneven queries
+        if (grain == 0) grain = max<size_t>(1, n/(workers.size()*8));
+        size_t numChunks = (n + grain - 1)/grain;
+        mutex doneMtx;
+        condition_variable doneCv;
+        size_t remain = numChunks;
+        for (size_t lo = 0; lo < n; lo += grain) {
+            size_t hi = min(n, lo + grain);
+            submit([&, lo, hi]() {
+                body(lo, hi);
+                lock_guard<mutex> lock(doneMtx);
+                if (--remain == 0) doneCv.notify_all();
+            });
+        }
+        unique_lock<mutex> lock(doneMtx);
+        doneCv.wait(lock, [&]() {return remain == 0;});
+    }
+};
+
+#endif // THREADPOOL_H
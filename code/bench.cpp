@@ -0,0 +1,509 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cmath>
+#include <random>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include "point&plane.h"
+#include "KDTree.h"
+#include "BoxKDTree.h"
+#include "ConcurrentIndex.h"
+#include "ShardedKDTree.h"
+#include "LSHash.h"
+#include "PointLoader.h"
+
+using namespace std;
+
+//////////////// non-interactive benchmark of KD TREE and LOCALITY SENSITIVE HASH
+//////////////// usage: bench [--n N] [--dim 2|3|8|16|32|64|128] [--data uniform|clustered|grid] [--seed S]
+////////////////              [--queries Q] [--knn K] [--radius R] [--threads T] [--format csv|json] [--out FILE]
+////////////////              [--lsh-l L] [--lsh-k K] [--tune 0|1] [--leaf B] [--epsilon E] [--max-visits V]
+////////////////              [--file POINTS] (binary or CSV points instead of --data, --n becomes the number read)
+////////////////              [--shards S] (regions of the sharded KD tree, default --threads)
+////////////////              [--curve none|morton|hilbert] (order of the points stored by KD tree and LSH)
+
+struct Options
+{
+    size_t n = 100000, queries = 1000, knn = 10, leaf = 16;
+    int dim = 3, threads = 1, shards = 0; // shards 0 means one per thread
+    int lshL = 20, lshK = -1; // k < 0 means log2(n)
+    bool tune = 0; // choose L and k of LSH with LSH::autoTune
+    unsigned seed = 12345;
+    float radius = 2;
+    float epsilon = 0; // approximate KD tree queries are measured if epsilon > 0 or maxVisits > 0
+    size_t maxVisits = 0;
+    string data = "uniform", format = "csv", out;
+    string file; // points are read from this file if it is given
+    CurveKind curve = CURVE_NONE;
+};
+
+struct Row ////// one measured operation
+{
+    string index, op;
+    size_t count = 0;
+    double totalMs = 0;
+    double p50Us = -1, p99Us = -1; // -1 if there is only one sample, its percentiles mean nothing
+    long long memory = -1; // -1 if not measured
+    double recall = -1; // -1 if not measured
+};
+
+class Timer
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+public:
+    double us() const {return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();}
+};
+
+////// summary of per-operation latencies, a single timed run like a build has no percentiles
+Row makeRow(const string& index, const string& op, vector<double>& lat, double totalUs)
+{
+    Row r;
+    r.index = index;
+    r.op = op;
+    r.count = lat.size();
+    r.totalMs = totalUs/1000;
+    if (lat.size() >= 2) {
+        sort(lat.begin(), lat.end());
+        r.p50Us = lat[lat.size()/2];
+        r.p99Us = lat[min(lat.size() - 1, lat.size()*99/100)];
+    }
+    return r;
+}
+
+////// points in [0, 100]^D, uniform, around 20 gaussian clusters, or on a grid of 3 values per coordinate
+////// where most points have many equal copies
+template<int D>
+vector<Point<D>> makeData(size_t n, const string& kind, mt19937& rng)
+{
+    vector<Point<D>> pts(n);
+    uniform_real_distribution<float> uni(0, 100);
+    if (kind == "grid") {
+        uniform_int_distribution<int> cell(0, 2);
+        for (auto& p : pts)
+            for (int i=0; i<D; i++) p[i] = 50.0f*cell(rng);
+    }
+    else if (kind == "clustered") {
+        const int numClusters = 20;
+        vector<Point<D>> centers(numClusters);
+        for (auto& c : centers)
+            for (int i=0; i<D; i++) c[i] = uniform_real_distribution<float>(10, 90)(rng);
+        normal_distribution<float> noise(0, 3);
+        uniform_int_distribution<int> pick(0, numClusters - 1);
+        for (auto& p : pts) {
+            const Point<D>& c = centers[pick(rng)];
+            for (int i=0; i<D; i++) p[i] = min(100.0f, max(0.0f, c[i] + noise(rng)));
+        }
+    }
+    else {
+        for (auto& p : pts)
+            for (int i=0; i<D; i++) p[i] = uni(rng);
+    }
+    return pts;
+}
+
+////// time f(i) for every i in [0, count), one latency per call
+template<class F>
+Row timeEach(const string& index, const string& op, size_t count, F f)
+{
+    vector<double> lat(count);
+    Timer total;
+    for (size_t i=0; i<count; i++) {
+        Timer t;
+        f(i);
+        lat[i] = t.us();
+    }
+    return makeRow(index, op, lat, total.us());
+}
+
+template<int D>
+vector<Row> runBench(Options& opt)
+{
+    typedef Point<D> P;
+    vector<Row> rows;
+    mt19937 rng(opt.seed);
+    vector<P> data;
+    if (!opt.file.empty()) {
+        ThreadPool pool(opt.threads);
+        vector<double> lat;
+        Timer t;
+        data = PointLoader<D>(opt.file, &pool).readAll();
+        lat.push_back(t.us());
+        rows.push_back(makeRow("loader", "read", lat, lat[0]));
+        rows.back().count = data.size();
+        if (data.empty()) throw "no point in the file";
+        opt.n = data.size(); // the writers report the number of points actually read
+        // read, parse, hash and insert as one pipeline
+        LSHParams params;
+        params.L = opt.lshL;
+        params.k = opt.lshK;
+        params.seed = opt.seed;
+        params.curve = opt.curve;
+        LSH<D> hashtable(opt.n, 0, 100, params);
+        lat.clear();
+        Timer s;
+        size_t count = PointLoader<D>(opt.file, &pool).forEachBatch([&](vector<P>& batch) {hashtable.insertBatch(batch, &pool);});
+        lat.push_back(s.us());
+        rows.push_back(makeRow("loader", "lsh-stream", lat, lat[0]));
+        rows.back().count = count;
+        rows.back().memory = hashtable.memoryUsage();
+    }
+    else data = makeData<D>(opt.n, opt.data, rng);
+    vector<P> queries = makeData<D>(opt.queries, opt.data, rng);
+
+    ////// KD TREE
+    KDTree<D> tree;
+    tree.setCurve(opt.curve);
+    {
+        vector<double> lat;
+        Timer t;
+        tree.build(data, opt.threads);
+        lat.push_back(t.us());
+        rows.push_back(makeRow("kdtree", "build", lat, lat[0]));
+        rows.back().memory = tree.memoryUsage();
+    }
+    // exact answers, they are the reference of the recall of LSH
+    vector<P> exactNearest(opt.queries);
+    vector<vector<P>> exactKnn(opt.queries), exactRadius(opt.queries);
+    rows.push_back(timeEach("kdtree", "nearest", opt.queries, [&](size_t i) {exactNearest[i] = tree.nearestPoint(queries[i]);}));
+    rows.push_back(timeEach("kdtree", "knn", opt.queries, [&](size_t i) {exactKnn[i] = tree.kNearest(queries[i], opt.knn);}));
+    rows.push_back(timeEach("kdtree", "radius", opt.queries, [&](size_t i) {exactRadius[i] = tree.closePoint(queries[i], opt.radius);}));
+    rows.push_back(timeEach("kdtree", "count", opt.queries, [&](size_t i) {tree.countInRadius(queries[i], opt.radius);}));
+    if (opt.epsilon > 0 || opt.maxVisits > 0) {
+        size_t hit = 0;
+        rows.push_back(timeEach("kdtree-approx", "nearest", opt.queries, [&](size_t i) {
+            P p = tree.nearestPoint(queries[i], opt.epsilon, opt.maxVisits);
+            hit += queries[i].squareDistance(p) <= queries[i].squareDistance(exactNearest[i]);
+        }));
+        rows.back().recall = double(hit)/max<size_t>(1, opt.queries);
+        size_t found = 0, total = 0;
+        rows.push_back(timeEach("kdtree-approx", "knn", opt.queries, [&](size_t i) {
+            vector<P> res = tree.kNearest(queries[i], opt.knn, opt.epsilon, opt.maxVisits);
+            float kth = exactKnn[i].empty() ? 0 : queries[i].squareDistance(exactKnn[i].back());
+            for (const P& p : res) found += queries[i].squareDistance(p) <= kth;
+            total += exactKnn[i].size();
+        }));
+        rows.back().recall = double(found)/max<size_t>(1, total);
+    }
+    {
+        KDTree<D> incremental;
+        rows.push_back(timeEach("kdtree", "insert", data.size(), [&](size_t i) {incremental.insert(data[i]);}));
+        rows.back().memory = incremental.memoryUsage();
+        size_t numRemove = data.size()/10;
+        rows.push_back(timeEach("kdtree", "remove", numRemove, [&](size_t i) {incremental.remove(data[i]);}));
+        // remove one more point and insert a removed one back, the cost includes the rebuilds of rebalancing
+        rows.push_back(timeEach("kdtree", "churn", numRemove, [&](size_t i) {
+            incremental.remove(data[numRemove + i]);
+            incremental.insert(data[i]);
+        }));
+    }
+
+    ////// CONCURRENT KD TREE: the second half of the points is inserted by a writer thread while queries run
+    {
+        typedef ConcurrentIndex<KDTree<D>, D> Concurrent;
+        typename Concurrent::Builder builder = [](vector<P>&& points) {return shared_ptr<const KDTree<D>>(new KDTree<D>(move(points)));};
+        size_t half = data.size()/2;
+        Concurrent index(builder, vector<P>(data.begin(), data.begin() + half));
+        Row writer;
+        thread writerThread([&]() {
+            writer = timeEach("concurrent-kdtree", "insert", data.size() - half, [&](size_t i) {index.insert(data[half + i]);});
+        });
+        rows.push_back(timeEach("concurrent-kdtree", "nearest", opt.queries, [&](size_t i) {index.nearestPoint(queries[i]);}));
+        writerThread.join();
+        rows.push_back(writer);
+    }
+
+    ////// SHARDED KD TREE: one tree per region, the trees are built, filled and searched at the same time
+    {
+        ThreadPool pool(opt.threads);
+        size_t numShards = opt.shards > 0 ? opt.shards : opt.threads;
+        ShardedKDTree<D> sharded(numShards);
+        vector<double> lat;
+        Timer t;
+        sharded.build(data, &pool);
+        lat.push_back(t.us());
+        rows.push_back(makeRow("sharded-kdtree", "build", lat, lat[0]));
+        size_t hit = 0;
+        rows.push_back(timeEach("sharded-kdtree", "nearest", opt.queries, [&](size_t i) {
+            hit += queries[i].squareDistance(sharded.nearestPoint(queries[i])) <= queries[i].squareDistance(exactNearest[i]);
+        }));
+        rows.back().recall = double(hit)/max<size_t>(1, opt.queries);
+        rows.push_back(timeEach("sharded-kdtree", "radius", opt.queries, [&](size_t i) {sharded.closePoint(queries[i], opt.radius, &pool);}));
+        vector<P> out(opt.queries);
+        lat.clear();
+        Timer b;
+        sharded.nearestPointBatch(queries.data(), opt.queries, out.data(), &pool);
+        lat.push_back(b.us());
+        rows.push_back(makeRow("sharded-kdtree", "nearest-batch", lat, lat[0]));
+        rows.back().count = opt.queries;
+
+        size_t half = data.size()/2;
+        ShardedKDTree<D> growing(numShards);
+        growing.build(vector<P>(data.begin(), data.begin() + half), &pool);
+        lat.clear();
+        Timer w;
+        growing.insertBatch(vector<P>(data.begin() + half, data.end()), &pool);
+        lat.push_back(w.us());
+        rows.push_back(makeRow("sharded-kdtree", "insert-batch", lat, lat[0]));
+        rows.back().count = data.size() - half;
+    }
+
+    ////// KD TREE WITH BOUNDING BOXES AND LEAF BUCKETS
+    {
+        BoxKDTree<D> boxTree(opt.leaf);
+        vector<double> lat;
+        Timer t;
+        boxTree.build(data);
+        lat.push_back(t.us());
+        rows.push_back(makeRow("boxkdtree", "build", lat, lat[0]));
+        rows.back().memory = boxTree.memoryUsage();
+        size_t hit = 0;
+        rows.push_back(timeEach("boxkdtree", "nearest", opt.queries, [&](size_t i) {
+            hit += queries[i].squareDistance(boxTree.nearestPoint(queries[i])) <= queries[i].squareDistance(exactNearest[i]);
+        }));
+        rows.back().recall = double(hit)/max<size_t>(1, opt.queries);
+        rows.push_back(timeEach("boxkdtree", "knn", opt.queries, [&](size_t i) {boxTree.kNearest(queries[i], opt.knn);}));
+        size_t found = 0, total = 0;
+        rows.push_back(timeEach("boxkdtree", "radius", opt.queries, [&](size_t i) {
+            found += boxTree.closePoint(queries[i], opt.radius).size();
+            total += exactRadius[i].size();
+        }));
+        rows.back().recall = total ? double(found)/total : 1;
+    }
+
+    ////// LOCALITY SENSITIVE HASH
+    LSHParams params;
+    params.L = opt.lshL;
+    params.k = opt.lshK;
+    params.seed = opt.seed;
+    if (opt.tune) {
+        vector<double> lat;
+        Timer t;
+        params = LSH<D>::autoTune(data, 0.9, 0, 100, opt.seed);
+        lat.push_back(t.us());
+        rows.push_back(makeRow("lsh", "tune L=" + to_string(params.L) + " k=" + to_string(params.k), lat, lat[0]));
+    }
+    params.curve = opt.curve;
+    {
+        // bulk build: all points are moved into the empty table at once
+        LSH<D> hashtable(opt.n, 0, 100, params);
+        vector<P> copy(data);
+        vector<double> lat;
+        Timer t;
+        hashtable.insert(move(copy));
+        lat.push_back(t.us());
+        rows.push_back(makeRow("lsh", "build", lat, lat[0]));
+        rows.back().count = data.size();
+        rows.back().memory = hashtable.memoryUsage();
+
+        size_t hit = 0;
+        rows.push_back(timeEach("lsh", "nearest", opt.queries, [&](size_t i) {
+            hit += queries[i].squareDistance(hashtable.nearestPoint(queries[i])) <= queries[i].squareDistance(exactNearest[i]);
+        }));
+        rows.back().recall = double(hit)/max<size_t>(1, opt.queries);
+
+        size_t found = 0, total = 0;
+        rows.push_back(timeEach("lsh", "knn", opt.queries, [&](size_t i) {
+            vector<P> res = hashtable.kNearest(queries[i], opt.knn);
+            // a result counts if it is not farther than the k-th exact neighbour
+            float kth = exactKnn[i].empty() ? 0 : queries[i].squareDistance(exactKnn[i].back());
+            for (const P& p : res) found += queries[i].squareDistance(p) <= kth;
+            total += exactKnn[i].size();
+        }));
+        rows.back().recall = double(found)/max<size_t>(1, total);
+
+        found = total = 0;
+        rows.push_back(timeEach("lsh", "radius", opt.queries, [&](size_t i) {
+            found += hashtable.closePoint(queries[i], opt.radius).size();
+            total += exactRadius[i].size();
+        }));
+        rows.back().recall = total ? double(found)/total : 1;
+        rows.push_back(timeEach("lsh", "count", opt.queries, [&](size_t i) {hashtable.countInRadius(queries[i], opt.radius);}));
+
+        size_t numRemove = data.size()/10;
+        rows.push_back(timeEach("lsh", "remove", numRemove, [&](size_t i) {hashtable.remove(data[i]);}));
+
+        lat.clear();
+        Timer f;
+        hashtable.freeze();
+        lat.push_back(f.us());
+        rows.push_back(makeRow("lsh-frozen", "freeze", lat, lat[0]));
+        rows.back().count = hashtable.getSize();
+        rows.back().memory = hashtable.memoryUsage();
+        rows.push_back(timeEach("lsh-frozen", "nearest", opt.queries, [&](size_t i) {hashtable.nearestPoint(queries[i]);}));
+        rows.back().memory = hashtable.memoryUsage();
+    }
+    {
+        LSH<D> incremental(opt.n, 0, 100, params);
+        rows.push_back(timeEach("lsh", "insert", data.size(), [&](size_t i) {incremental.insert(data[i]);}));
+    }
+    {
+        // the points hashed in parallel on the pool, then put into the buckets in one pass
+        ThreadPool pool(opt.threads);
+        LSH<D> batched(opt.n, 0, 100, params);
+        vector<double> lat;
+        Timer t;
+        batched.insertBatch(data, &pool);
+        lat.push_back(t.us());
+        rows.push_back(makeRow("lsh", "insert-batch", lat, lat[0]));
+        rows.back().count = data.size();
+    }
+    {
+        // made for 1000 points, the tables grow while all points are inserted
+        LSHParams small = params;
+        small.k = -1;
+        LSH<D> grown(1000, 0, 100, small);
+        rows.push_back(timeEach("lsh-grown", "insert", data.size(), [&](size_t i) {grown.insert(data[i]);}));
+        size_t hit = 0;
+        rows.push_back(timeEach("lsh-grown", "nearest", opt.queries, [&](size_t i) {
+            hit += queries[i].squareDistance(grown.nearestPoint(queries[i])) <= queries[i].squareDistance(exactNearest[i]);
+        }));
+        rows.back().recall = double(hit)/max<size_t>(1, opt.queries);
+        rows.back().memory = grown.memoryUsage();
+    }
+    {
+        // points on the plane which splits the buckets: the sign of their hash bit is decided by rounding, and insert,
+        // split, countInRadius and remove must still agree on it. Build with -mavx2 -mfma to check the vector kernel
+        LSHParams exact = params;
+        exact.L = 1;
+        exact.k = 5;
+        exact.maxLoad = 2;
+        LSH<D> hashtable(1 << exact.k, 0, 100, exact);
+        const CutPlane<D>& plane = hashtable.getPlane(0, exact.k);
+        vector<P> onPlane(4 << exact.k);
+        for (P& p : onPlane) {
+            p = makeData<D>(1, "uniform", rng)[0];
+            double value = plane.getCoef(D), norm = 0;
+            for (int u=0; u<D; u++) {
+                value += double(plane.getCoef(u))*p[u];
+                norm += double(plane.getCoef(u))*plane.getCoef(u);
+            }
+            for (int u=0; u<D; u++) p[u] = float(p[u] - value*plane.getCoef(u)/norm);
+            hashtable.insert(p);
+        }
+        size_t found = 0;
+        rows.push_back(timeEach("lsh-split", "remove", onPlane.size(), [&](size_t i) {
+            found += hashtable.countInRadius(onPlane[i], 0) > 0 && hashtable.remove(onPlane[i]);
+        }));
+        rows.back().recall = double(found)/onPlane.size();
+        if (found != onPlane.size()) throw "a point of a split LSH bucket is lost";
+    }
+    return rows;
+}
+
+////// name of the indexed points, the file they were read from or the generated distribution
+string dataName(const Options& opt)
+{
+    return opt.file.empty() ? opt.data : opt.file;
+}
+
+void writeCsv(ostream& out, const Options& opt, const vector<Row>& rows)
+{
+    out << "index,op,n,dim,data,seed,count,total_ms,qps,p50_us,p99_us,memory_bytes,recall\n";
+    for (const Row& r : rows) {
+        out << r.index << "," << r.op << "," << opt.n << "," << opt.dim << "," << dataName(opt) << "," << opt.seed << ","
+            << r.count << "," << r.totalMs << "," << (r.totalMs > 0 ? r.count*1000.0/r.totalMs : 0) << ",";
+        if (r.p50Us >= 0) out << r.p50Us;
+        out << ",";
+        if (r.p99Us >= 0) out << r.p99Us;
+        out << ",";
+        if (r.memory >= 0) out << r.memory;
+        out << ",";
+        if (r.recall >= 0) out << r.recall;
+        out << "\n";
+    }
+}
+
+void writeJson(ostream& out, const Options& opt, const vector<Row>& rows)
+{
+    out << "{\"n\": " << opt.n << ", \"dim\": " << opt.dim << ", \"data\": \"" << dataName(opt) << "\", \"seed\": " << opt.seed
+        << ", \"queries\": " << opt.queries << ", \"knn\": " << opt.knn << ", \"radius\": " << opt.radius << ",\n \"results\": [\n";
+    for (size_t i=0; i<rows.size(); i++) {
+        const Row& r = rows[i];
+        out << "  {\"index\": \"" << r.index << "\", \"op\": \"" << r.op << "\", \"count\": " << r.count
+            << ", \"total_ms\": " << r.totalMs << ", \"qps\": " << (r.totalMs > 0 ? r.count*1000.0/r.totalMs : 0);
+        if (r.p50Us >= 0) out << ", \"p50_us\": " << r.p50Us << ", \"p99_us\": " << r.p99Us;
+        if (r.memory >= 0) out << ", \"memory_bytes\": " << r.memory;
+        if (r.recall >= 0) out << ", \"recall\": " << r.recall;
+        out << "}" << (i + 1 < rows.size() ? "," : "") << "\n";
+    }
+    out << " ]}\n";
+}
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    for (int i=1; i<argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "- Missing value of " << arg << "\n";
+            return 1;
+        }
+        string val = argv[++i];
+        if (arg == "--n") opt.n = stoul(val);
+        else if (arg == "--dim") opt.dim = stoi(val);
+        else if (arg == "--data") opt.data = val;
+        else if (arg == "--seed") opt.seed = stoul(val);
+        else if (arg == "--queries") opt.queries = stoul(val);
+        else if (arg == "--knn") opt.knn = stoul(val);
+        else if (arg == "--radius") opt.radius = stof(val);
+        else if (arg == "--threads") opt.threads = stoi(val);
+        else if (arg == "--format") opt.format = val;
+        else if (arg == "--out") opt.out = val;
+        else if (arg == "--lsh-l") opt.lshL = stoi(val);
+        else if (arg == "--lsh-k") opt.lshK = stoi(val);
+        else if (arg == "--tune") opt.tune = stoi(val);
+        else if (arg == "--leaf") opt.leaf = stoul(val);
+        else if (arg == "--epsilon") opt.epsilon = stof(val);
+        else if (arg == "--max-visits") opt.maxVisits = stoul(val);
+        else if (arg == "--file") opt.file = val;
+        else if (arg == "--shards") opt.shards = stoi(val);
+        else if (arg == "--curve") {
+            if (val == "morton") opt.curve = CURVE_MORTON;
+            else if (val == "hilbert") opt.curve = CURVE_HILBERT;
+            else if (val == "none") opt.curve = CURVE_NONE;
+            else {
+                cerr << "- Unknown curve " << val << "\n";
+                return 1;
+            }
+        }
+        else {
+            cerr << "- Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    if (opt.n == 0) {
+        cerr << "- The number of points must be positive\n";
+        return 1;
+    }
+
+    vector<Row> rows;
+    try {
+        switch (opt.dim) {
+            case 2: rows = runBench<2>(opt); break;
+            case 3: rows = runBench<3>(opt); break;
+            case 8: rows = runBench<8>(opt); break;
+            case 16: rows = runBench<16>(opt); break;
+            case 32: rows = runBench<32>(opt); break;
+            case 64: rows = runBench<64>(opt); break;
+            case 128: rows = runBench<128>(opt); break;
+            default:
+                cerr << "- Dimension " << opt.dim << " is not compiled, use 2, 3, 8, 16, 32, 64 or 128\n";
+                return 1;
+        }
+    }
+    catch (const char* error) {
+        cerr << "- " << error << "\n";
+        return 1;
+    }
+
+    ofstream fout;
+    if (!opt.out.empty()) fout.open(opt.out);
+    ostream& out = opt.out.empty() ? cout : fout;
+    if (opt.format == "json") writeJson(out, opt, rows);
+    else writeCsv(out, opt, rows);
+    return 0;
+}
@@ -7,9 +7,11 @@
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <climits>
 #include "point&plane.h"
 #include "KDTree.h"
 #include "LSHash.h"
+#include "PointLoader.h"
 
 using namespace std;
 
@@ -43,22 +45,41 @@ T getInput(T min, T max, const string& des)
     return n;
 }
 
-int main()
+////// usage: main [points file], the file is binary or CSV (see PointLoader.h), random points are made without it
+int main(int argc, char** argv)
 {
-    int n = getInput(1, INT_MAX, "the number of points");
-    cerr << "setting ...\n";
-    vector<Point3D> database(n);
-    mt19937 rng(static_cast<int>(time(nullptr)));
-    uniform_int_distribution<int> dis(0, 100000);
-    for (int i=0; i<n; i++) {
-        database[i] = Point3D(dis(rng)/1000.0, dis(rng)/1000.0, dis(rng)/1000.0);
+    vector<Point3D> database;
+    if (argc > 1) {
+        cerr << "loading " << argv[1] << " ...\n";
+        ThreadPool pool;
+        try {
+            database = PointLoader<>(argv[1], &pool).readAll();
+        }
+        catch (const char* error) {
+            cerr << "- " << error << "\n";
+            return 1;
+        }
+        if (database.empty()) {
+            cerr << "- No point in " << argv[1] << "\n";
+            return 1;
+        }
     }
-    KDTree tree;
-    LSH hashtable(n);
-    for (const Point3D& x : database) {
-        tree.insert(x);
-        hashtable.insert(x);
+    else {
+        int n = getInput(1, INT_MAX, "the number of points");
+        cerr << "setting ...\n";
+        database.resize(n);
+        mt19937 rng(static_cast<int>(time(nullptr)));
+        uniform_int_distribution<int> dis(0, 100000);
+        for (int i=0; i<n; i++) {
+            database[i] = Point3D(dis(rng)/1000.0, dis(rng)/1000.0, dis(rng)/1000.0);
+        }
     }
+    // both structures keep their own points, the database can be moved into the hash table
+    KDTree<> tree;
+    tree.build(database, thread::hardware_concurrency());
+    LSH<> hashtable(database.size());
+    hashtable.insert(move(database));
+    hashtable.freeze(); // the tables are not changed any more
     while (true) {
         cout << "/////////////////////////////\n";
         cout << "- Select Options:\n";
@@ -66,8 +87,9 @@ int main()
         cout << setw(5) << 2 << ": SEARCH FOR ANY POINT IN A INPUT DISTANCE\n";
         cout << setw(5) << 3 << ": PRINT K-D TREE\n";
         cout << setw(5) << 4 << ": PRINT HASH TABLE\n";
-        cout << setw(5) << 5 << ": EXIT\n";
-        int opt = getInput(1, 5, "option");
+        cout << setw(5) << 5 << ": PRINT STATISTICS\n";
+        cout << setw(5) << 6 << ": EXIT\n";
+        int opt = getInput(1, 6, "option");
         if (opt==1) {
             cout << "- DOING: SEARCH FOR NEAREST POINT\n";
             float x = round(getInput(0.0f, 100.0f, "x value")*1000.0)/1000.0;
@@ -116,6 +138,13 @@ int main()
             int itab = getInput(0, 19, "an index of subtable(default 0->19)");
             hashtable.print(itab);
         }
+        else if (opt==5) {
+            cout << "- DOING: PRINT STATISTICS\n";
+            tree.printStats();
+            hashtable.printStats();
+            // the query counters are 0 unless the program is compiled with -DQUERY_STATS
+            QueryStats::total().write(cout);
+        }
         else break;
         system("pause");
     }
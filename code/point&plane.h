@@ -10,92 +10,161 @@
 #include <iomanip>
 #include <sstream>
 #include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
 
 using namespace std;
 
-class Node;
-class KDTree;
-
-class Point3D
+////// point with D coordinates of type T, the dimension is known at compile time so loops over it are unrolled
+template<int D, class T = float>
+class Point
 {
-    friend class Node;
-    friend class KDTree;
-    float x, y, z;
+    T coord[D];
 public:
-    Point3D(float x = 0, float y = 0, float z = 0) : x(x), y(y), z(z) {}
-    float& operator[](int n) ////// access x, y, z with index 0, 1, 2
-    {
-        if (n==0) return x;
-        else if (n==1) return y;
-        else if (n==2) return z;
-        else throw "out of index\n";
-    }
-    const float& operator[](int n) const
+    static const int dim = D;
+    typedef T value_type;
+
+    ////// Point(x, y, z, ...), missing coordinates are 0
+    template<class... Args, class = typename enable_if<conjunction<is_arithmetic<Args>...>::value>::type>
+    Point(Args... args) : coord{T(args)...}
     {
-        if (n==0) return x;
-        else if (n==1) return y;
-        else if (n==2) return z;
-        else throw "out of index\n";
+        static_assert(sizeof...(Args) <= size_t(D), "too many coordinates");
     }
-    bool operator==(const Point3D& p) const ////// compare 2 points
+    T& operator[](int n) {return coord[n];} ////// access x, y, z, ... with index 0, 1, 2, ...
+    const T& operator[](int n) const {return coord[n];}
+    bool operator==(const Point& p) const ////// compare 2 points
     {
-        return x==p.x && y==p.y && z==p.z;
+        for (int i=0; i<D; i++)
+            if (coord[i] != p.coord[i]) return 0;
+        return 1;
     }
-    friend ostream& operator<<(ostream& out, const Point3D& p) ////// print Point
+    friend ostream& operator<<(ostream& out, const Point& p) ////// print Point
     {
         ostringstream sout;
-        sout << "(" << p.x << "," << p.y << "," << p.z << ")";
+        sout << "(" << p.coord[0];
+        for (int i=1; i<D; i++) sout << "," << p.coord[i];
+        sout << ")";
         out << sout.str();
         return out;
     }
-    float squareDistance(const Point3D& p) const ////// the Euclidean distance between two points without the square root
+    T squareDistance(const Point& p) const ////// the Euclidean distance between two points without the square root
     {
-        return (x - p.x)*(x - p.x) + (y - p.y)*(y - p.y) + (z - p.z)*(z - p.z);
+        return squareDistanceImpl(p, make_integer_sequence<int, (D <= 8 ? D : 0)>());
+    }
+private:
+    ////// small dimension: one expression, the compiler sees every term
+    template<int... I>
+    T squareDistanceImpl(const Point& p, integer_sequence<int, I...>) const
+    {
+        if constexpr (D <= 8) {
+            return (((coord[I] - p.coord[I])*(coord[I] - p.coord[I])) + ...);
+        }
+        else {
+            // large dimension: 8 independent sums, so the compiler can use vector registers without reordering a sum
+            T acc[8] = {};
+            const int FULL = D - D%8; // coordinates in whole groups of 8
+            for (int i=0; i<FULL; i += 8) {
+                for (int l=0; l<8; l++) acc[l] += (coord[i + l] - p.coord[i + l])*(coord[i + l] - p.coord[i + l]);
+            }
+            // the tail is compiled only if there is one, so no loop can look past the last coordinate
+            if constexpr (D%8 != 0) {
+                for (int l=0; l<D%8; l++) acc[l] += (coord[FULL + l] - p.coord[FULL + l])*(coord[FULL + l] - p.coord[FULL + l]);
+            }
+            return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+        }
     }
 };
 
-///////////////// class Plane
-class CutPlane
+typedef Point<3, float> Point3D;
+
+///////////////// result of a nearest point search, point is nullptr if nothing was found
+template<class P>
+struct NearestResult
 {
-    int d;
-    vector<int> plane;
+    const P* point = nullptr;
+    typename P::value_type squareDistance = numeric_limits<typename P::value_type>::max();
+};
+
+///////////////// bounded max heap keeping the k nearest points found so far
+template<class P>
+class KNearestHeap
+{
+    typedef typename P::value_type T;
+    size_t k;
+    vector<pair<T, const P*>> heap; // max heap on the square distance to the key
 public:
-    CutPlane(const vector<int>& nplane, int d = 3)
+    KNearestHeap(size_t k) : k(k) {heap.reserve(k + 1);}
+
+    bool full() const {return heap.size() >= k;}
+
+    T worst() const ////// the square distance of the k-th nearest point, max of T if less than k points found
     {
-        this->d = d;
-        plane = nplane;
-        if (int(plane.size()) < d+1) {
-            for (int i=plane.size(); i<d+1; i++) plane.push_back(0);
+        return full() ? heap.front().first : numeric_limits<T>::max();
+    }
+
+    void push(T sqDis, const P* p)
+    {
+        if (k == 0) return;
+        if (full()) {
+            if (sqDis >= heap.front().first) return;
+            pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
         }
-        else if (plane.size() > size_t(d+1)) plane.resize(d+1);
+        heap.push_back(make_pair(sqDis, p));
+        push_heap(heap.begin(), heap.end());
+    }
+
+    vector<P> sorted() const ////// points sorted by distance, nearest first
+    {
+        vector<pair<T, const P*>> arr = heap;
+        sort_heap(arr.begin(), arr.end());
+        vector<P> res;
+        res.reserve(arr.size());
+        for (auto& x : arr) res.push_back(*x.second);
+        return res;
+    }
+};
+
+///////////////// class Plane, a0*x0 + a1*x1 + ... + a(D-1)*x(D-1) + aD = 0
+template<int D, class T = float>
+class CutPlane
+{
+    T plane[D+1];
+public:
+    CutPlane(const vector<T>& nplane)
+    {
+        // missing coefficients are 0
+        for (int i=0; i<=D; i++) plane[i] = (size_t(i) < nplane.size()) ? nplane[i] : 0;
     }
 
-    float getValue(const Point3D& key) const ////////// get the value when x, y, z are replaced by key.x, key.y, key.z
+    T getCoef(int i) const {return plane[i];} ////// coefficient of x, y, z, ... with index 0, 1, 2, ... and the constant with index D
+
+    T getValue(const Point<D, T>& key) const ////////// get the value when x, y, z, ... are replaced by key
     {
-        float exp = plane[d];
-        for (int i=0; i<d; i++)
+        T exp = plane[D];
+        for (int i=0; i<D; i++)
             exp += key[i]*plane[i];
         return exp;
     }
 
-    float squareDistance(const Point3D& key) const ////// the Euclidean distance between a point and this plane without the square root
+    T squareDistance(const Point<D, T>& key) const ////// the Euclidean distance between a point and this plane without the square root
     {
-        float sqabs = plane[d];
-        for (int i=0; i<d; i++)
-            sqabs += key[i]*plane[i];
+        T sqabs = getValue(key);
         sqabs *= sqabs;
-        float sqvec = 0;
-        for (int i=0; i<d; i++)
+        T sqvec = 0;
+        for (int i=0; i<D; i++)
             sqvec += plane[i]*plane[i];
         return sqabs/sqvec;
     }
 
-    void print()
+    void print() const
     {
-        for (size_t i=0; i<plane.size() - 1; i++) {
-            cout << plane[i] << char('x' + i) << " + ";
+        for (int i=0; i<D; i++) {
+            if (D <= 3) cout << plane[i] << char('x' + i) << " + ";
+            else cout << plane[i] << "x" << i << " + ";
         }
-        cout << plane[plane.size() - 1] << " = 0\n";
+        cout << plane[D] << " = 0\n";
     }
 };
 